@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+set -eu
+
+cd $(dirname $0)
+BUILDDIR=build/jit/$(uname)-$(uname -m)
+cmake -DCMAKE_BUILD_TYPE=Release -DENABLE_JIT=On -B $BUILDDIR .
+cmake --build $BUILDDIR -j
+cp $BUILDDIR/rosettaboy-cpp ./rosettaboy-jit
@@ -1,135 +1,327 @@
 #include <SDL2/SDL.h>
+#include <algorithm>
 
 #include "apu.h"
+#include "errors.h"
+#include "wav.h"
 
-u32 HZ = 48000; // 44100;
-u8 duty[4][8] = {
+const u8 duty[4][8] = {
     {1, 0, 0, 0, 0, 0, 0, 0},
     {1, 1, 0, 0, 0, 0, 0, 0},
     {1, 1, 1, 1, 0, 0, 0, 0},
     {1, 1, 1, 1, 1, 1, 0, 0},
 };
 
-static int hz_to_samples(int hz) {
-    if(hz == 0) return HZ;
-    if(hz > HZ) return 1;
-    return HZ / hz;
+// The APU counts in hardware clocks, which are 1/4 of a CPU cycle (see
+// GameBoy::run) - the wave channel can step every 2 clocks
+const int CLOCKS_PER_CYCLE = 4;
+const int CLOCKS_PER_SECOND = 4194304;
+// How often the length counters, sweep and envelopes tick
+const int LENGTH_CLOCKS = CLOCKS_PER_SECOND / 256;
+const int SWEEP_CLOCKS = CLOCKS_PER_SECOND / 128;
+const int ENVELOPE_CLOCKS = CLOCKS_PER_SECOND / 64;
+// Render at least every ~8ms, so the audio device doesn't wait long
+const int MAX_SPAN = 1 << 15;
+// How loud a level of 1 is, on a side at master volume 1 - four channels
+// at 15 and master volume 7 come to 26880, which leaves some headroom
+const int VOLUME_SCALE = 64;
+
+/**
+ * The channels' timers - their settings are all in RAM - and what the
+ * Blips have been told so far. Samples which have been generated but
+ * not played yet aren't part of the machine.
+ */
+void APU::save_state(StateWriter *out) {
+    out->put(this->pending);
+    out->put(this->ch1_freq_timer);
+    out->put(this->ch2_freq_timer);
+    out->put(this->ch3_freq_timer);
+    out->put(this->ch4_freq_timer);
+    out->put(this->ch1_envelope_vol);
+    out->put(this->ch2_envelope_vol);
+    out->put(this->ch4_envelope_vol);
+    out->put(this->ch1_sweep_timer);
+    out->put(this->ch1_shadow_freq);
+    out->put(this->ch1_envelope_timer);
+    out->put(this->ch2_envelope_timer);
+    out->put(this->ch4_envelope_timer);
+    out->put(this->ch1_length_timer);
+    out->put(this->ch2_length_timer);
+    out->put(this->ch3_length_timer);
+    out->put(this->ch4_length_timer);
+    out->put(this->ch1_length);
+    out->put(this->ch2_length);
+    out->put(this->ch3_length);
+    out->put(this->ch4_length);
+    out->put(this->ch1_sweep);
+    out->put(this->ch1_duty_pos);
+    out->put(this->ch2_duty_pos);
+    out->put(this->ch3_sample);
+    out->put(this->ch4_lfsr);
+    out->put(this->level);
+    out->put(this->out_left);
+    out->put(this->out_right);
+    this->left.save_state(out);
+    this->right.save_state(out);
 }
 
-#define LENGTH_COUNTER(ch)                                                                                             \
-    if(ch##_dat->length_enable == 1) {                                                                                 \
-        if(this->ch##_length > 0) {                                                                                    \
-            this->ch##_length_timer = (this->ch##_length_timer + 1) % hz_to_samples(256);                              \
-            if(this->ch##_length_timer == 0) this->ch##_length--;                                                      \
-            ch_control->ch##_active = true;                                                                            \
-        } else {                                                                                                       \
-            ch_control->ch##_active = false;                                                                           \
-        }                                                                                                              \
-    } else {                                                                                                           \
-        ch_control->ch##_active = true;                                                                                \
-    }                                                                                                                  \
-    ch = ch * (ch_control->ch##_active ? 1 : 0);
-
-#define ENVELOPE(ch)                                                                                                   \
-    if(ch##_dat->envelope_period) {                                                                                    \
-        this->ch##_envelope_timer = (this->ch##_envelope_timer + 1) % (ch##_dat->envelope_period * hz_to_samples(64)); \
-        if(this->ch##_envelope_timer == 0) {                                                                           \
-            if(ch##_dat->envelope_direction == 0) {                                                                    \
-                if(ch##_envelope_vol > 0) ch##_envelope_vol--;                                                         \
-            } else {                                                                                                   \
-                if(ch##_envelope_vol < 0x0F) ch##_envelope_vol++;                                                      \
-            }                                                                                                          \
-        }                                                                                                              \
-    }                                                                                                                  \
-    ch = ch * ch##_envelope_vol / 0x0F;
-
-APU::APU(CPU *cpu, bool debug) {
-    SDL_InitSubSystem(SDL_INIT_AUDIO);
+void APU::load_state(StateReader *in) {
+    in->get(this->pending);
+    in->get(this->ch1_freq_timer);
+    in->get(this->ch2_freq_timer);
+    in->get(this->ch3_freq_timer);
+    in->get(this->ch4_freq_timer);
+    in->get(this->ch1_envelope_vol);
+    in->get(this->ch2_envelope_vol);
+    in->get(this->ch4_envelope_vol);
+    in->get(this->ch1_sweep_timer);
+    in->get(this->ch1_shadow_freq);
+    in->get(this->ch1_envelope_timer);
+    in->get(this->ch2_envelope_timer);
+    in->get(this->ch4_envelope_timer);
+    in->get(this->ch1_length_timer);
+    in->get(this->ch2_length_timer);
+    in->get(this->ch3_length_timer);
+    in->get(this->ch4_length_timer);
+    in->get(this->ch1_length);
+    in->get(this->ch2_length);
+    in->get(this->ch3_length);
+    in->get(this->ch4_length);
+    in->get(this->ch1_sweep);
+    in->get(this->ch1_duty_pos);
+    in->get(this->ch2_duty_pos);
+    in->get(this->ch3_sample);
+    in->get(this->ch4_lfsr);
+    in->get(this->level);
+    in->get(this->out_left);
+    in->get(this->out_right);
+    this->left.load_state(in);
+    this->right.load_state(in);
+}
 
+/**
+ * Samples are generated on the emulator's thread as the cycles go by,
+ * and queued up in `samples`. If `open_device` is set, SDL takes them
+ * from there on its audio thread, otherwise the owner takes them with
+ * GameBoy::audio_samples(). Each APU opens its own device, so several
+ * can play at once.
+ */
+APU::APU(CPU *cpu, int rate, bool debug, bool open_device)
+    : left(CLOCKS_PER_SECOND, rate, MAX_SPAN), right(CLOCKS_PER_SECOND, rate, MAX_SPAN) {
     this->cpu = cpu;
     this->debug = debug;
+    this->cpu->ram->defer_sound_writes = true;
+    if(!open_device) return;
+
+    SDL_InitSubSystem(SDL_INIT_AUDIO);
 
     SDL_AudioSpec desiredSpec, obtainedSpec;
-    desiredSpec.freq = HZ;
-    desiredSpec.format = AUDIO_U8; // AUDIO_S16SYS;
+    desiredSpec.freq = rate;
+    desiredSpec.format = AUDIO_S16SYS;
     desiredSpec.channels = 2;
-    desiredSpec.samples = (HZ / 60); // generate audio for one frame at a time, 735 samples per frame
+    desiredSpec.samples = (rate / 60); // generate audio for one frame at a time, 800 samples per frame at 48kHz
     desiredSpec.callback = audio_callback;
     desiredSpec.userdata = this;
-    SDL_OpenAudio(&desiredSpec, &obtainedSpec); // check for errors?
-    SDL_PauseAudio(false);
+    this->device = SDL_OpenAudioDevice(NULL, 0, &desiredSpec, &obtainedSpec, 0); // check for errors?
+    if(this->device) SDL_PauseAudioDevice(this->device, false);
 }
 
-APU::~APU() { SDL_CloseAudio(); }
+APU::~APU() {
+    // Whatever hasn't been generated yet would be missing from the end -
+    // and there's no throwing from here, so a failed write is only reported
+    if(this->file) {
+        try {
+            this->sync();
+        } catch(AudioFileError *e) {
+            fprintf(stderr, "%s\n", e->what());
+            delete e;
+        }
+    }
+    if(this->device) {
+        SDL_CloseAudioDevice(this->device);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    }
+}
 
-u16 APU::get_next_sample() {
-    //=================================================================
-    // Control
+/**
+ * Forget about the audio device and file without closing them, so that a
+ * forked copy of us leaves the parent's alone (the file's writer thread
+ * only exists in the parent, so we can't even clean up our copy of it)
+ */
+void APU::detach() {
+    this->device = 0;
+    this->file.release();
+}
 
-    ch_control_t *ch_control = (ch_control_t *)&this->cpu->ram->data[Mem::NR50];
+/**
+ * Count the clocks which have passed - the sound for them is only
+ * generated once enough have built up to be worth doing in one go, or
+ * when a sound register is about to change
+ */
+void APU::tick(int cycles) {
+    this->pending += cycles * CLOCKS_PER_CYCLE;
+    if(this->pending >= MAX_SPAN || this->cpu->ram->sound_written) this->sync();
+}
 
-    if(!ch_control->snd_enable) {
-        // TODO: wipe all registers
-        return 0;
+/**
+ * Generate the sound for all of the clocks which have passed, and queue
+ * up the samples (or write them out, if we have a file). If they aren't
+ * being taken as fast as we make them (eg in turbo mode), the ones which
+ * don't fit in the queue are dropped. Then apply the
+ * sound register write which was waiting for us to catch up, if there is
+ * one.
+ */
+void APU::sync() {
+    while(this->pending > 0) {
+        int clocks = std::min(this->pending, MAX_SPAN);
+        this->render(clocks);
+        this->pending -= clocks;
+
+        StereoSample buf[256];
+        while(int n = this->left.read_samples(&buf[0].left, 256, 2)) {
+            this->right.read_samples(&buf[0].right, n, 2);
+            if(this->file) {
+                this->file->write(buf, n);
+            } else {
+                this->samples.push(buf, n);
+            }
+        }
     }
 
-    u8 *ram = this->cpu->ram->data;
-    u8 ch1 = this->get_ch1_sample(ch_control, (ch1_dat_t *)&ram[Mem::NR10]);
-    u8 ch2 = this->get_ch2_sample(ch_control, (ch2_dat_t *)&ram[Mem::NR20]);
-    u8 ch3 = this->get_ch3_sample(ch_control, (ch3_dat_t *)&ram[Mem::NR30]);
-    u8 ch4 = this->get_ch4_sample(ch_control, (ch4_dat_t *)&ram[Mem::NR40]);
-
-    //=================================================================
-    // Mixer
-
-    // clang-format off
-    u8 s01 = (
-        (ch1 >> 2) * ch_control->ch1_to_s01 +
-        (ch2 >> 2) * ch_control->ch2_to_s01 +
-        (ch3 >> 2) * ch_control->ch3_to_s01 +
-        (ch4 >> 2) * ch_control->ch4_to_s01
-    ) * ch_control->s01_volume / 4;
-    u8 s02 = (
-        (ch1 >> 2) * ch_control->ch1_to_s02 +
-        (ch2 >> 2) * ch_control->ch2_to_s02 +
-        (ch3 >> 2) * ch_control->ch3_to_s02 +
-        (ch4 >> 2) * ch_control->ch4_to_s02
-    ) * ch_control->s02_volume / 4;
-    // clang-format on
-    return s01 << 8 | s02; // s01 = right, s02 = left
+    RAM *ram = this->cpu->ram;
+    if(ram->sound_written) {
+        ram->data[ram->sound_write_addr] = ram->sound_write_val;
+        ram->sound_written = false;
+    }
 }
 
-u8 APU::get_ch1_sample(ch_control_t *ch_control, ch1_dat_t *ch1_dat) {
-    //=================================================================
-    // Square 1: Sweep -> Timer -> Duty -> Length Counter -> Envelope -> Mixer
+/**
+ * Channel `ch`'s output changes to `level` at `time` - pass the change
+ * on to whichever sides it's playing on
+ */
+void APU::set_level(int ch, int time, int level) {
+    int delta = level - this->level[ch];
+    if(delta == 0) return;
+    this->level[ch] = level;
+    if(this->gain_left[ch]) {
+        this->left.add_delta(time, delta * this->gain_left[ch] * VOLUME_SCALE);
+        this->out_left += delta * this->gain_left[ch];
+    }
+    if(this->gain_right[ch]) {
+        this->right.add_delta(time, delta * this->gain_right[ch] * VOLUME_SCALE);
+        this->out_right += delta * this->gain_right[ch];
+    }
+}
 
-    // Sweep
-    if(ch1_dat->sweep_period) {
-        this->ch1_sweep_timer = (this->ch1_sweep_timer + 1) % (ch1_dat->sweep_period * hz_to_samples(128));
-        if(this->ch1_sweep_timer == 0) {
-            u8 sweep_adj = ch1_dat->sweep_negate ? -1 : 1;
-            this->ch1_sweep += sweep_adj;
+/**
+ * The parts which every channel has in common, for `clocks` clocks. The
+ * channel's frequency timer counts up to `period`, and then `step()`
+ * moves it along its waveform; its length counter (if enabled) counts
+ * down, and silences it once it runs out; and its envelope (if it has
+ * one - `vol` is null if not) fades its volume in or out.
+ *
+ * Between those events the output doesn't change, so we skip straight
+ * from one event to the next, and only tell the Blips about the ones
+ * where the output does change - so the cost depends on how many edges
+ * the waveform has, not on the output rate. Returns whether the channel
+ * is still playing.
+ */
+template <typename Step, typename Value>
+bool APU::render_channel(int ch, int clocks, int period, int &freq_timer, Step step, Value value, bool length_enable,
+                         int &length, int &length_timer, int envelope_period, bool envelope_up, int *vol,
+                         int &envelope_timer) {
+    const int envelope_len = envelope_period * ENVELOPE_CLOCKS;
+    auto output = [&]() {
+        if(length_enable && length == 0) return 0;
+        return vol ? value() * *vol / 0x0F : value();
+    };
+
+    // The registers may have changed since last time
+    this->set_level(ch, 0, output());
+
+    // The period may have changed too, so bring the timers back into
+    // range once here, rather than dividing on every event
+    freq_timer %= period;
+    length_timer %= LENGTH_CLOCKS;
+    if(envelope_period) envelope_timer %= envelope_len;
+
+    for(int t = 0; t < clocks;) {
+        // The run ends with the first clock where anything happens, or
+        // the end of the span, in which case none of the timers wrap
+        bool counting = length_enable && length > 0;
+        int run = std::min(clocks - t, period - freq_timer);
+        if(counting) run = std::min(run, LENGTH_CLOCKS - length_timer);
+        if(envelope_period) run = std::min(run, envelope_len - envelope_timer);
+        t += run;
+
+        freq_timer += run;
+        if(freq_timer == period) {
+            freq_timer = 0;
+            step();
+        }
+        if(counting) {
+            length_timer += run;
+            if(length_timer == LENGTH_CLOCKS) {
+                length_timer = 0;
+                length--;
+            }
+        }
+        if(envelope_period) {
+            envelope_timer += run;
+            if(envelope_timer == envelope_len) {
+                envelope_timer = 0;
+                if(!envelope_up && *vol > 0) (*vol)--;
+                if(envelope_up && *vol < 0x0F) (*vol)++;
+            }
         }
+        this->set_level(ch, t, output());
     }
+    return !length_enable || length > 0;
+}
 
-    // Timer
-    // 1651 -> 330Hz
-    u16 ch1_freq = 131072 / (2048 - ((ch1_dat->frequency_msb << 8) | ch1_dat->frequency_lsb));
-    // x8 to get through the whole 8-bit cycle every HZ
-    // "ch1_freq = 1750" = A = 440Hz.
-    this->ch1_freq_timer = (this->ch1_freq_timer + 1) % hz_to_samples(ch1_freq * 8);
-
-    // Duty
-    if(this->ch1_freq_timer == 0) {
-        this->ch1_duty_pos = (this->ch1_duty_pos + 1) % 8;
+/**
+ * Generate the next `clocks` clocks of sound - the mixer first, since if
+ * NR50 / NR51 changed, every channel's volume on each side changes now
+ */
+void APU::render(int clocks) {
+    u8 *ram = this->cpu->ram->data;
+    ch_control_t *ch_control = (ch_control_t *)&ram[Mem::NR50];
+
+    bool on = ch_control->snd_enable;
+    const bool to_left[4] = {(bool)ch_control->ch1_to_s02, (bool)ch_control->ch2_to_s02,
+                             (bool)ch_control->ch3_to_s02, (bool)ch_control->ch4_to_s02};
+    const bool to_right[4] = {(bool)ch_control->ch1_to_s01, (bool)ch_control->ch2_to_s01,
+                              (bool)ch_control->ch3_to_s01, (bool)ch_control->ch4_to_s01};
+    int total_left = 0, total_right = 0;
+    for(int ch = 0; ch < 4; ch++) {
+        this->gain_left[ch] = on && to_left[ch] ? ch_control->s02_volume : 0; // s02 = left
+        this->gain_right[ch] = on && to_right[ch] ? ch_control->s01_volume : 0; // s01 = right
+        total_left += this->level[ch] * this->gain_left[ch];
+        total_right += this->level[ch] * this->gain_right[ch];
     }
-    u8 ch1 = duty[ch1_dat->duty][this->ch1_duty_pos] * 0xFF;
+    if(total_left != this->out_left) this->left.add_delta(0, (total_left - this->out_left) * VOLUME_SCALE);
+    if(total_right != this->out_right) this->right.add_delta(0, (total_right - this->out_right) * VOLUME_SCALE);
+    this->out_left = total_left;
+    this->out_right = total_right;
+
+    // TODO: wipe all registers when sound is turned off
+    if(on) {
+        this->render_ch1(ch_control, (ch1_dat_t *)&ram[Mem::NR10], clocks);
+        this->render_ch2(ch_control, (ch2_dat_t *)&ram[Mem::NR20], clocks);
+        this->render_ch3(ch_control, (ch3_dat_t *)&ram[Mem::NR30], clocks);
+        this->render_ch4(ch_control, (ch4_dat_t *)&ram[Mem::NR40], clocks);
+    }
+    this->left.end_frame(clocks);
+    this->right.end_frame(clocks);
+}
 
-    // Length Counter
-    LENGTH_COUNTER(ch1);
+void APU::render_ch1(ch_control_t *ch_control, ch1_dat_t *ch1_dat, int clocks) {
+    //=================================================================
+    // Square 1: Sweep -> Timer -> Duty -> Length Counter -> Envelope -> Mixer
 
-    // Envelope
-    ENVELOPE(ch1);
+    // 1651 -> 330Hz
+    int ch1_x = (ch1_dat->frequency_msb << 8) | ch1_dat->frequency_lsb;
+    u16 ch1_freq = 131072 / (2048 - ch1_x);
 
     // Reset handler
     if(ch1_dat->reset) {
@@ -144,29 +336,29 @@ u8 APU::get_ch1_sample(ch_control_t *ch_control, ch1_dat_t *ch1_dat) {
         this->ch1_shadow_freq = ch1_freq;
     }
 
-    return ch1;
+    // Sweep (which doesn't affect the output yet, so can be done in one go)
+    if(ch1_dat->sweep_period) {
+        int sweep_len = ch1_dat->sweep_period * SWEEP_CLOCKS;
+        int sweeps = (this->ch1_sweep_timer + clocks) / sweep_len - this->ch1_sweep_timer / sweep_len;
+        this->ch1_sweep_timer = (this->ch1_sweep_timer + clocks) % sweep_len;
+        u8 sweep_adj = ch1_dat->sweep_negate ? -1 : 1;
+        this->ch1_sweep += sweep_adj * sweeps;
+    }
+
+    // Timer -> Duty, stepping 8 times per wave
+    const u8 *wave = duty[ch1_dat->duty];
+    ch_control->ch1_active = this->render_channel(
+        0, clocks, (2048 - ch1_x) * 4, this->ch1_freq_timer,
+        [this]() { this->ch1_duty_pos = (this->ch1_duty_pos + 1) % 8; },
+        [this, wave]() { return wave[this->ch1_duty_pos] * 0x0F; }, ch1_dat->length_enable, this->ch1_length,
+        this->ch1_length_timer, ch1_dat->envelope_period, ch1_dat->envelope_direction, &this->ch1_envelope_vol,
+        this->ch1_envelope_timer);
 }
 
-u8 APU::get_ch2_sample(ch_control_t *ch_control, ch2_dat_t *ch2_dat) {
+void APU::render_ch2(ch_control_t *ch_control, ch2_dat_t *ch2_dat, int clocks) {
     //=================================================================
     // Square 2:          Timer -> Duty -> Length Counter -> Envelope -> Mixer
 
-    // Timer
-    u16 ch2_freq = 131072 / (2048 - ((ch2_dat->frequency_msb << 8) | ch2_dat->frequency_lsb));
-    this->ch2_freq_timer = (this->ch2_freq_timer + 1) % hz_to_samples(ch2_freq * 8);
-
-    // Duty
-    if(ch2_freq_timer == 0) {
-        this->ch2_duty_pos = (this->ch2_duty_pos + 1) % 8;
-    }
-    u8 ch2 = duty[ch2_dat->duty][this->ch2_duty_pos] * 0xFF;
-
-    // Length Counter
-    LENGTH_COUNTER(ch2);
-
-    // Envelope
-    ENVELOPE(ch2);
-
     // Reset handler
     if(ch2_dat->reset) {
         ch2_dat->reset = 0;
@@ -177,45 +369,21 @@ u8 APU::get_ch2_sample(ch_control_t *ch_control, ch2_dat_t *ch2_dat) {
         this->ch2_envelope_vol = ch2_dat->envelope_vol_load; // volume reloaded from NRx2
     }
 
-    return ch2;
+    // Timer -> Duty, stepping 8 times per wave
+    int ch2_x = (ch2_dat->frequency_msb << 8) | ch2_dat->frequency_lsb;
+    const u8 *wave = duty[ch2_dat->duty];
+    ch_control->ch2_active = this->render_channel(
+        1, clocks, (2048 - ch2_x) * 4, this->ch2_freq_timer,
+        [this]() { this->ch2_duty_pos = (this->ch2_duty_pos + 1) % 8; },
+        [this, wave]() { return wave[this->ch2_duty_pos] * 0x0F; }, ch2_dat->length_enable, this->ch2_length,
+        this->ch2_length_timer, ch2_dat->envelope_period, ch2_dat->envelope_direction, &this->ch2_envelope_vol,
+        this->ch2_envelope_timer);
 }
 
-u8 APU::get_ch3_sample(ch_control_t *ch_control, ch3_dat_t *ch3_dat) {
+void APU::render_ch3(ch_control_t *ch_control, ch3_dat_t *ch3_dat, int clocks) {
     //=================================================================
     // Wave:              Timer -> Wave -> Length Counter -> Volume -> Mixer
 
-    // Timer
-    u16 ch3_freq = 65536 / (2048 - ((ch3_dat->frequency_msb << 8) | ch3_dat->frequency_lsb));
-    this->ch3_freq_timer = (this->ch3_freq_timer + 1) % hz_to_samples(ch3_freq * 8);
-    // do we want one 4-bit sample, or 32 4-bit samples to appear $freq times per sec?
-    // assuming here that we want the whole waveform N times/sec
-    if(this->ch3_freq_timer == 0) {
-        this->ch3_sample = (this->ch3_sample + 1) % WAVE_LEN;
-    }
-
-    // Wave
-    u8 ch3 = 127;
-    if(ch3_dat->enabled) {
-        u8 *ch3_samples = &this->cpu->ram->data[0xFF30]; // until 0xFF3F
-        if(this->ch3_sample % 2 == 0) {
-            ch3 = ch3_samples[this->ch3_sample / 2] & 0xF0;
-        } else {
-            ch3 = (ch3_samples[this->ch3_sample / 2] & 0x0F) << 4;
-        }
-    } else {
-        ch3 = 0;
-        this->ch3_sample = 0;
-    }
-
-    // Length Counter
-    LENGTH_COUNTER(ch3);
-
-    // Volume
-    if(ch3_dat->volume == 0)
-        ch3 = 0;
-    else
-        ch3 >>= (ch3_dat->volume - 1);
-
     // Reset handler
     if(ch3_dat->reset) {
         ch3_dat->reset = 0;
@@ -224,42 +392,33 @@ u8 APU::get_ch3_sample(ch_control_t *ch_control, ch3_dat_t *ch3_dat) {
         this->ch3_freq_timer = 1; // frequency timer reloaded with period
         this->ch3_sample = 0;     // wave channel's position set to 0
     }
-    return ch3;
+
+    // Timer -> Wave, stepping 32 times per wave
+    int ch3_x = (ch3_dat->frequency_msb << 8) | ch3_dat->frequency_lsb;
+    u8 *ch3_samples = &this->cpu->ram->data[Mem::WAVE];
+    // While the channel is off, its position is held at 0
+    if(!ch3_dat->enabled) this->ch3_sample = 0;
+    bool enabled = ch3_dat->enabled;
+    int shift = ch3_dat->volume ? ch3_dat->volume - 1 : 4;
+    int envelope_timer = 0;
+    ch_control->ch3_active = this->render_channel(
+        2, clocks, (2048 - ch3_x) * 2, this->ch3_freq_timer,
+        [this, enabled]() {
+            if(enabled) this->ch3_sample = (this->ch3_sample + 1) % WAVE_LEN;
+        },
+        [this, enabled, ch3_samples, shift]() {
+            if(!enabled) return 0;
+            u8 byte = ch3_samples[this->ch3_sample / 2];
+            u8 ch3 = this->ch3_sample % 2 == 0 ? byte >> 4 : byte & 0x0F;
+            return ch3 >> shift;
+        },
+        ch3_dat->length_enable, this->ch3_length, this->ch3_length_timer, 0, false, nullptr, envelope_timer);
 }
 
-u8 APU::get_ch4_sample(ch_control_t *ch_control, ch4_dat_t *ch4_dat) {
+void APU::render_ch4(ch_control_t *ch_control, ch4_dat_t *ch4_dat, int clocks) {
     //=================================================================
     // Noise:             Timer -> LFSR -> Length Counter -> Envelope -> Mixer
 
-    // Timer
-    int ch4_div = 0;
-    switch(ch4_dat->divisor_code) {
-        case 0: ch4_div = 8; break;
-        case 1: ch4_div = 16; break;
-        case 2: ch4_div = 32; break;
-        case 3: ch4_div = 48; break;
-        case 4: ch4_div = 64; break;
-        case 5: ch4_div = 80; break;
-        case 6: ch4_div = 96; break;
-        case 7: ch4_div = 112; break;
-    }
-    this->ch4_freq_timer = (this->ch4_freq_timer + 1) % (ch4_div << ch4_dat->clock_shift);
-
-    // LFSR
-    if(this->ch4_freq_timer == 0) {
-        u8 new_bit = ((ch4_lfsr & 0b10) >> 1) ^ (ch4_lfsr & 0b01);                      // xor two low bits
-        ch4_lfsr >>= 1;                                                                 // shift right
-        ch4_lfsr |= new_bit << 14;                                                      // bit15 = new
-        if(ch4_dat->lfsr_mode == 1) ch4_lfsr = (ch4_lfsr & ~(1 << 6)) | (new_bit << 6); // bit7 = new
-    }
-    u8 ch4 = 0xFF - ((ch4_lfsr & 0b01) * 0xFF); // bit0, inverted
-
-    // Length Counter
-    LENGTH_COUNTER(ch4);
-
-    // Envelope
-    ENVELOPE(ch4);
-
     // Reset handler
     if(ch4_dat->reset) {
         ch4_dat->reset = 0;
@@ -271,15 +430,37 @@ u8 APU::get_ch4_sample(ch_control_t *ch_control, ch4_dat_t *ch4_dat) {
         this->ch4_lfsr = 0xFFFF;                             // ch4_lfsr bits all set to 1
     }
 
-    return ch4;
+    // Timer -> LFSR
+    const int divisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+    bool narrow = ch4_dat->lfsr_mode == 1;
+    ch_control->ch4_active = this->render_channel(
+        3, clocks, divisors[ch4_dat->divisor_code] << ch4_dat->clock_shift, this->ch4_freq_timer,
+        [this, narrow]() {
+            u16 lfsr = this->ch4_lfsr;
+            u8 new_bit = ((lfsr & 0b10) >> 1) ^ (lfsr & 0b01);     // xor two low bits
+            lfsr >>= 1;                                            // shift right
+            lfsr |= new_bit << 14;                                 // bit15 = new
+            if(narrow) lfsr = (lfsr & ~(1 << 6)) | (new_bit << 6); // bit7 = new
+            this->ch4_lfsr = lfsr;
+        },
+        [this]() { return 0x0F - ((this->ch4_lfsr & 0b01) * 0x0F); }, // bit0, inverted
+        ch4_dat->length_enable, this->ch4_length, this->ch4_length_timer, ch4_dat->envelope_period,
+        ch4_dat->envelope_direction, &this->ch4_envelope_vol, this->ch4_envelope_timer);
 }
 
+/**
+ * Runs on SDL's audio thread, so it only touches the queue of finished
+ * samples. If the emulator has fallen behind, we hold the last sample
+ * rather than dropping to zero, which would click.
+ */
 void audio_callback(void *_sound, Uint8 *_stream, int _length) {
-    u16 *stream = (u16 *)_stream;
+    StereoSample *stream = (StereoSample *)_stream;
     APU *sound = (APU *)_sound;
     int length = _length / sizeof(stream[0]);
 
-    for(int i = 0; i < length; i++) {
-        stream[i] = sound->get_next_sample();
+    int got = sound->samples.pop(stream, length);
+    if(got > 0) sound->last_played = stream[got - 1];
+    for(int i = got; i < length; i++) {
+        stream[i] = sound->last_played;
     }
 }
@@ -2,10 +2,19 @@
 #define ROSETTABOY_APU_H
 
 #include <SDL2/SDL.h>
+#include <memory>
 
+#include "blip.h"
 #include "cpu.h"
+#include "ring.h"
 
-static int WAVE_LEN = 32;
+const int WAVE_LEN = 32;
+
+// One sample for each speaker, as SDL's AUDIO_S16SYS stereo wants them
+struct StereoSample {
+    i16 left;
+    i16 right;
+};
 
 struct ch1_dat_t {
     // NR10
@@ -132,6 +141,8 @@ struct ch_control_t {
     unsigned int snd_enable : 1;
 };
 
+class WavFile;
+
 class APU {
 private:
     bool debug = false;
@@ -146,20 +157,49 @@ private:
     u8 ch2_duty_pos = 0;
     u8 ch3_sample = 0;
     u16 ch4_lfsr = 0xFFFF;
+    // Clocks which have passed since the last sync()
+    int pending = 0;
+    // What each channel is outputting right now (0-15), how loud each
+    // channel is on each side, and what each side's level is - as far
+    // as the Blips have been told
+    int level[4] = {0, 0, 0, 0};
+    int gain_left[4] = {0, 0, 0, 0}, gain_right[4] = {0, 0, 0, 0};
+    int out_left = 0, out_right = 0;
+    Blip left, right;
 
 public:
     CPU *cpu = nullptr;
+    // The SDL audio device pulling samples from us, or 0 if none
+    SDL_AudioDeviceID device = 0;
+    // A file to write samples to instead of queueing them, if set
+    std::unique_ptr<WavFile> file;
+    // Samples which have been generated but not played yet - ~85ms
+    // worth at 96kHz, which is plenty for a device pulling one frame
+    // at a time
+    Ring<StereoSample, 8192> samples;
+    // The audio thread's own copy of the last sample it played
+    StereoSample last_played = {0, 0};
 
 public:
-    APU(CPU *cpu, bool debug);
+    APU(CPU *cpu, int rate, bool debug, bool open_device);
     ~APU();
-    u16 get_next_sample();
+    void tick(int cycles);
+    void sync();
+    void detach();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
 
 private:
-    u8 get_ch1_sample(ch_control_t *ch_control, ch1_dat_t *ch_dat);
-    u8 get_ch2_sample(ch_control_t *ch_control, ch2_dat_t *ch_dat);
-    u8 get_ch3_sample(ch_control_t *ch_control, ch3_dat_t *ch_dat);
-    u8 get_ch4_sample(ch_control_t *ch_control, ch4_dat_t *ch_dat);
+    void render(int clocks);
+    void render_ch1(ch_control_t *ch_control, ch1_dat_t *ch1_dat, int clocks);
+    void render_ch2(ch_control_t *ch_control, ch2_dat_t *ch2_dat, int clocks);
+    void render_ch3(ch_control_t *ch_control, ch3_dat_t *ch3_dat, int clocks);
+    void render_ch4(ch_control_t *ch_control, ch4_dat_t *ch4_dat, int clocks);
+    void set_level(int ch, int time, int level);
+    template <typename Step, typename Value>
+    bool render_channel(int ch, int clocks, int period, int &freq_timer, Step step, Value value, bool length_enable,
+                        int &length, int &length_timer, int envelope_period, bool envelope_up, int *vol,
+                        int &envelope_timer);
 };
 
 void audio_callback(void *, Uint8 *, int);
@@ -14,6 +14,20 @@ Args::Args(int argc, char *argv[]) {
     args::ValueFlag<int> frames(parser, "frames", "Exit after N frames", {'f', "frames"});
     args::ValueFlag<int> profile(parser, "profile", "Exit after N seconds", {'p', "profile"});
     args::Flag turbo(parser, "turbo", "No sleep between frames", {'t', "turbo"});
+    args::Flag no_render(parser, "no-render", "Don't draw frames (LCD timing is unchanged)", {"no-render"});
+    args::ValueFlag<int> render_every(parser, "render-every", "Only draw every Nth frame", {"render-every"});
+    args::ValueFlag<int> rewind(parser, "rewind", "Hold backspace to go back up to N seconds, 0 - 3600",
+                                {"rewind"});
+    args::ValueFlag<int> rewind_memory(parser, "rewind-memory", "Memory for --rewind, in MB, 1 - 4096 (default 64)",
+                                       {"rewind-memory"});
+    args::ValueFlag<int> audio_rate(parser, "audio-rate", "Sound output rate in Hz, 22050 - 96000 (default 48000)",
+                                    {"audio-rate"});
+    args::ValueFlag<std::string> audio_out(parser, "audio-out",
+                                           "Write sound to a .wav (or raw PCM) file instead of playing it",
+                                           {"audio-out"});
+    args::ValueFlag<std::string> stats(parser, "stats",
+                                       "Write per-frame timings and counters to a .json (or .csv) file", {"stats"});
+    args::ValueFlag<std::string> boot(parser, "boot", "Path to a boot ROM (default: boot.gb if it exists)", {"boot"});
     args::Positional<std::string> rom(parser, "rom", "Path to a .gb file");
     args::CompletionFlag completion(parser, {"complete"});
 
@@ -42,5 +56,32 @@ Args::Args(int argc, char *argv[]) {
     this->frames = frames ? args::get(frames) : 0;
     this->profile = profile ? args::get(profile) : 0;
     this->turbo = turbo;
+    this->render_every = no_render ? 0 : render_every ? args::get(render_every) : 1;
+    this->rewind = rewind ? args::get(rewind) : 0;
+    this->rewind_memory = rewind_memory ? args::get(rewind_memory) : 64;
+    this->audio_rate = audio_rate ? args::get(audio_rate) : 48000;
+    this->audio_out = audio_out ? args::get(audio_out) : "";
+    this->stats = stats ? args::get(stats) : "";
+    this->boot = boot ? args::get(boot) : "boot.gb";
     this->rom = args::get(rom);
+
+    if(this->audio_rate < 22050 || this->audio_rate > 96000) {
+        std::cerr << "--audio-rate must be between 22050 and 96000" << std::endl << parser;
+        this->exit_code = 1;
+    }
+    if(this->rewind < 0 || this->rewind > 3600) {
+        std::cerr << "--rewind must be between 0 and 3600 seconds" << std::endl << parser;
+        this->exit_code = 1;
+    }
+    // The history's memory is all allocated up front
+    if(this->rewind_memory < 1 || this->rewind_memory > 4096) {
+        std::cerr << "--rewind-memory must be between 1 and 4096 MB" << std::endl << parser;
+        this->exit_code = 1;
+    }
+#ifndef ENABLE_STATS
+    if(!this->stats.empty()) {
+        std::cerr << "--stats needs a build with ENABLE_STATS (see build_stats.sh)" << std::endl;
+        this->exit_code = 1;
+    }
+#endif
 }
\ No newline at end of file
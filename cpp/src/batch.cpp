@@ -0,0 +1,176 @@
+/**
+ * Run a batch of test ROMs in parallel, one GameBoy per worker thread,
+ * and report how each one went as JSON - eg:
+ *
+ *   rosettaboy-batch --threads 64 gb-autotest-roms/
+ *
+ * With --repeat N, each ROM is run N times at once, and every run is
+ * expected to end in exactly the same state - a stress test for
+ * instances sharing anything they shouldn't.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "_args.h"
+#include "errors.h"
+#include "gameboy.h"
+
+struct Result {
+    std::string rom;
+    std::string result = "timeout";
+    std::string error;
+    int frames = 0;
+    double duration = 0;
+    u32 hash = 0;
+
+    Result(const std::string &rom) { this->rom = rom; }
+};
+
+// FNV-1a of the visible screen
+u32 hash_screen(SDL_Surface *surface) {
+    u32 hash = 2166136261;
+    for(int y = 0; y < 144; y++) {
+        u8 *row = (u8 *)surface->pixels + y * surface->pitch;
+        for(int x = 0; x < 160 * 4; x++) {
+            hash = (hash ^ row[x]) * 16777619;
+        }
+    }
+    return hash;
+}
+
+void run_rom(Result *result, int max_frames, bool render) {
+    GameBoyOptions options;
+    options.rom = result->rom;
+    options.headless = true;
+    options.silent = true;
+    options.save = false;
+    options.turbo = true;
+    options.render_every = render ? 1 : 0;
+    options.print_serial = false;
+
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<GameBoy> gameboy;
+    try {
+        gameboy = std::make_unique<GameBoy>(options);
+        while(result->frames < max_frames) {
+            gameboy->run_frame();
+            result->frames++;
+        }
+    } catch(UnitTestPassed *e) {
+        result->result = "passed";
+        delete e;
+    } catch(UnitTestFailed *e) {
+        result->result = "failed";
+        delete e;
+    } catch(EmuException *e) {
+        result->result = "crashed";
+        result->error = e->what();
+        delete e;
+    } catch(std::exception &e) {
+        result->result = "crashed";
+        result->error = e.what();
+    }
+    result->duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(render && gameboy) result->hash = hash_screen(gameboy->framebuffer());
+}
+
+std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for(char c : s) {
+        switch(c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            default:
+                if((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+int main(int argc, char *argv[]) {
+    args::ArgumentParser parser("RosettaBoy - C++ batch runner", "");
+    args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+    args::ValueFlag<int> threads(parser, "threads", "How many ROMs to run in parallel", {'j', "threads"});
+    args::ValueFlag<int> frames(parser, "frames", "Give up on a ROM after N frames", {'f', "frames"});
+    args::ValueFlag<int> repeat(parser, "repeat", "Run each ROM N times and check they all match", {'r', "repeat"});
+    args::PositionalList<std::string> paths(parser, "paths", ".gb files, or directories to search for them");
+
+    try {
+        parser.ParseCLI(argc, argv);
+    } catch(args::Help) {
+        std::cout << parser;
+        return 0;
+    } catch(args::ParseError e) {
+        std::cerr << e.what() << std::endl << parser;
+        return 1;
+    }
+
+    std::vector<Result> results;
+    for(auto &path : args::get(paths)) {
+        if(std::filesystem::is_directory(path)) {
+            for(auto &entry : std::filesystem::recursive_directory_iterator(path)) {
+                if(entry.path().extension() == ".gb") results.emplace_back(entry.path().string());
+            }
+        } else {
+            results.emplace_back(path);
+        }
+    }
+    std::sort(results.begin(), results.end(), [](Result &a, Result &b) { return a.rom < b.rom; });
+
+    int n_repeats = repeat ? std::max(1, args::get(repeat)) : 1;
+    std::vector<Result> roms = results;
+    results.clear();
+    for(auto &rom : roms) {
+        results.insert(results.end(), n_repeats, rom);
+    }
+
+    int max_frames = frames ? args::get(frames) : 2000;
+    int n_threads = threads ? args::get(threads) : std::thread::hardware_concurrency();
+    n_threads = std::max(1, std::min(n_threads, (int)results.size()));
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for(int i = 0; i < n_threads; i++) {
+        workers.emplace_back([&]() {
+            for(size_t n = next++; n < results.size(); n = next++) {
+                run_rom(&results[n], max_frames, n_repeats > 1);
+            }
+        });
+    }
+    for(auto &worker : workers) {
+        worker.join();
+    }
+
+    int passed = 0;
+    bool consistent = true;
+    printf("{\"results\": [\n");
+    for(size_t n = 0; n < results.size(); n++) {
+        auto &r = results[n];
+        if(r.result == "passed") passed++;
+        auto &first = results[n - n % n_repeats];
+        if(r.result != first.result || r.frames != first.frames || r.hash != first.hash) consistent = false;
+        printf("  {\"rom\": %s, \"result\": \"%s\", \"frames\": %d, \"seconds\": %.3f, \"fps\": %.0f",
+               json_string(r.rom).c_str(), r.result.c_str(), r.frames, r.duration,
+               r.duration > 0 ? r.frames / r.duration : 0);
+        if(n_repeats > 1) printf(", \"hash\": \"%08x\"", r.hash);
+        if(!r.error.empty()) printf(", \"error\": %s", json_string(r.error).c_str());
+        printf("}%s\n", n + 1 < results.size() ? "," : "");
+    }
+    printf("], \"passed\": %d, \"total\": %zu", passed, results.size());
+    if(n_repeats > 1) printf(", \"consistent\": %s", consistent ? "true" : "false");
+    printf("}\n");
+
+    return passed == (int)results.size() && consistent ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+/**
+ * Microbenchmark for the tile decoders and palette lookups in tiles.cpp
+ *
+ * Each implementation is checked against the scalar one, then timed on
+ * a screen-sized batch of tile rows and pixels.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "tiles.h"
+
+const int ROWS = 384 * 8; // all the tile data in VRAM
+const int PIXELS = 160 * 144;
+const int ROUNDS = 2000;
+
+double time_ns(void (*fn)(const Tiles::Impl &, const u8 *, u8 *, u32 *), const Tiles::Impl &impl, const u8 *in,
+               u8 *indices, u32 *pixels) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < ROUNDS; i++) {
+        fn(impl, in, indices, pixels);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / ROUNDS;
+}
+
+void run_decode(const Tiles::Impl &impl, const u8 *in, u8 *indices, u32 *) {
+    impl.decode_rows(in, ROWS, indices);
+}
+
+void run_palette(const Tiles::Impl &impl, const u8 *in, u8 *, u32 *pixels) {
+    const u32 palette[4] = {0xFF0FBC9B, 0xFF0FAC8B, 0xFF306230, 0xFF0F380F};
+    impl.map_palette(in, PIXELS, palette, pixels);
+}
+
+int main() {
+    std::vector<const Tiles::Impl *> impls = {&Tiles::SCALAR};
+#if defined(__x86_64__)
+    impls.push_back(&Tiles::SSE2);
+    if(__builtin_cpu_supports("avx2")) impls.push_back(&Tiles::AVX2);
+#endif
+
+    srand(0);
+    std::vector<u8> rows(ROWS * 2), colors(PIXELS);
+    for(auto &b : rows) b = rand() & 0xFF;
+    for(auto &c : colors) c = rand() & 0x03;
+
+    std::vector<u8> want_indices(ROWS * 8), indices(ROWS * 8);
+    std::vector<u32> want_pixels(PIXELS), pixels(PIXELS);
+    run_decode(Tiles::SCALAR, rows.data(), want_indices.data(), nullptr);
+    run_palette(Tiles::SCALAR, colors.data(), nullptr, want_pixels.data());
+
+    printf("best implementation: %s\n", Tiles::best.name);
+    printf("%-8s %16s %16s\n", "", "decode (ns/row)", "palette (ns/px)");
+    for(auto impl : impls) {
+        run_decode(*impl, rows.data(), indices.data(), nullptr);
+        run_palette(*impl, colors.data(), nullptr, pixels.data());
+        if(indices != want_indices || pixels != want_pixels) {
+            printf("%s: output doesn't match scalar\n", impl->name);
+            return 1;
+        }
+
+        double decode = time_ns(run_decode, *impl, rows.data(), indices.data(), nullptr) / ROWS;
+        double palette = time_ns(run_palette, *impl, colors.data(), nullptr, pixels.data()) / PIXELS;
+        printf("%-8s %16.3f %16.3f\n", impl->name, decode, palette);
+    }
+    return 0;
+}
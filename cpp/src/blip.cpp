@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "blip.h"
+
+// Where a step lands between two samples is rounded to 1/PHASES of a
+// sample, and each step is spread over WIDTH samples
+const int PHASE_BITS = 5;
+const int PHASES = 1 << PHASE_BITS;
+const int WIDTH = 16;
+// A kernel's taps add up to 1 << KERNEL_BITS
+const int KERNEL_BITS = 14;
+// The output drifts back to 0 by 1/2^BASS_SHIFT per sample, so a DC
+// offset doesn't eat into the headroom (a ~15Hz high-pass at 48kHz)
+const int BASS_SHIFT = 9;
+// Keep a little below Nyquist, since a 16-tap sinc rolls off slowly
+const double CUTOFF = 0.9;
+
+/**
+ * One band-limited impulse per phase - a Blackman-windowed sinc, delayed
+ * by WIDTH/2 - 1 samples plus the phase. Each one is rounded so that its
+ * taps add up to exactly 1 << KERNEL_BITS, so that after any number of
+ * steps the integrated output lands exactly on the right level.
+ */
+struct Kernel {
+    int taps[PHASES][WIDTH];
+
+    Kernel() {
+        for(int p = 0; p < PHASES; p++) {
+            double ideal[WIDTH], sum = 0;
+            for(int i = 0; i < WIDTH; i++) {
+                double x = i - (WIDTH / 2 - 1) - (double)p / PHASES;
+                double sinc = x == 0 ? 1 : sin(M_PI * CUTOFF * x) / (M_PI * CUTOFF * x);
+                double window = 0.42 + 0.5 * cos(2 * M_PI * x / WIDTH) + 0.08 * cos(4 * M_PI * x / WIDTH);
+                ideal[i] = sinc * window;
+                sum += ideal[i];
+            }
+            int total = 0, biggest = 0;
+            for(int i = 0; i < WIDTH; i++) {
+                this->taps[p][i] = (int)lround(ideal[i] / sum * (1 << KERNEL_BITS));
+                total += this->taps[p][i];
+                if(this->taps[p][i] > this->taps[p][biggest]) biggest = i;
+            }
+            this->taps[p][biggest] += (1 << KERNEL_BITS) - total;
+        }
+    }
+};
+static const Kernel KERNEL;
+
+/**
+ * `max_frame_clocks` is the longest frame that will be asked for, which
+ * decides how big the buffer needs to be
+ */
+Blip::Blip(int clock_rate, int sample_rate, int max_frame_clocks) {
+    this->factor = ((uint64_t)sample_rate << 32) / clock_rate;
+    this->max_samples = ((uint64_t)max_frame_clocks * this->factor >> 32) + 1;
+    this->buf.resize(this->max_samples + WIDTH + 1);
+}
+
+/**
+ * Add a step of `delta` at `time` clocks after the end of the last frame
+ */
+void Blip::add_delta(u32 time, int delta) {
+    uint64_t pos = this->offset + time * this->factor;
+    int *out = &this->buf[pos >> 32];
+    const int *taps = KERNEL.taps[(pos >> (32 - PHASE_BITS)) & (PHASES - 1)];
+    for(int i = 0; i < WIDTH; i++) out[i] += taps[i] * delta;
+}
+
+/**
+ * Finish the frame at `clocks` - any samples before that point can't be
+ * touched by later steps, so they become available to read
+ */
+void Blip::end_frame(u32 clocks) { this->offset += clocks * this->factor; }
+
+/**
+ * Take up to `count` samples, writing every `stride`th element of `out`
+ * (so that left and right can be written straight into one stereo
+ * buffer), and return how many were taken
+ */
+int Blip::read_samples(i16 *out, int count, int stride) {
+    count = std::min(count, this->samples_avail());
+    int sum = this->integrator;
+    for(int i = 0; i < count; i++) {
+        sum += this->buf[i];
+        int s = sum >> KERNEL_BITS;
+        out[i * stride] = std::clamp(s, -32768, 32767);
+        sum -= s * (1 << (KERNEL_BITS - BASS_SHIFT));
+    }
+    this->integrator = sum;
+
+    // Shift the rest of the buffer (including the tails of the last few
+    // impulses) down to the start
+    int remaining = this->samples_avail() - count + WIDTH;
+    memmove(this->buf.data(), this->buf.data() + count, remaining * sizeof(int));
+    std::fill(this->buf.begin() + remaining, this->buf.begin() + remaining + count, 0);
+    this->offset -= (uint64_t)count << 32;
+    return count;
+}
+
+void Blip::save_state(StateWriter *out) {
+    u32 len = this->samples_avail() + WIDTH;
+    out->put(this->offset);
+    out->put(this->integrator);
+    out->put(len);
+    out->put(this->buf.data(), len * sizeof(int));
+}
+
+void Blip::load_state(StateReader *in) {
+    uint64_t offset;
+    int integrator;
+    u32 len;
+    in->read(offset);
+    in->read(integrator);
+    in->read(len);
+    // Whatever hadn't been read out yet has to leave room for a whole
+    // frame after it, as add_delta() expects
+    uint64_t avail = offset >> 32;
+    if(len != avail + WIDTH || avail + this->max_samples + WIDTH + 1 > this->buf.size()) {
+        throw new InvalidSaveState("audio buffer doesn't fit");
+    }
+    if(in->checking) {
+        in->skip(len * sizeof(int));
+        return;
+    }
+
+    this->offset = offset;
+    this->integrator = integrator;
+    std::fill(this->buf.begin(), this->buf.end(), 0);
+    in->get(this->buf.data(), len * sizeof(int));
+}
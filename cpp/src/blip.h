@@ -0,0 +1,49 @@
+#ifndef ROSETTABOY_BLIP_H
+#define ROSETTABOY_BLIP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "consts.h"
+#include "state.h"
+
+/**
+ * Turns a waveform made of steps - "at clock T, the level went up by D" -
+ * into samples at any output rate, without the aliasing that comes from
+ * rounding each step to the nearest sample.
+ *
+ * Each step is added as a band-limited impulse (a windowed sinc, offset by
+ * where between two samples the step lands), and reading the samples out
+ * integrates the impulses back into steps. So the work done per step is a
+ * fixed handful of multiply-adds, and the work done per sample is one add -
+ * a waveform which is flat most of the time costs next to nothing, at any
+ * output rate.
+ *
+ * Time is counted from the end of the last frame: add_delta() steps up
+ * to `clocks`, then end_frame(clocks), after which every sample up to that
+ * point can be read out.
+ */
+class Blip {
+public:
+    Blip(int clock_rate, int sample_rate, int max_frame_clocks);
+    void add_delta(u32 time, int delta);
+    void end_frame(u32 clocks);
+    int samples_avail() { return this->offset >> 32; }
+    int read_samples(i16 *out, int count, int stride);
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
+
+private:
+    // Samples per clock, and the position of the start of the current
+    // frame in `buf` - both in samples, as 32.32 fixed-point
+    uint64_t factor;
+    uint64_t offset = 0;
+    // The most samples one frame can make
+    int max_samples;
+    // The running sum of the impulses read out so far, which is the
+    // current level (in kernel units, minus the DC which has leaked away)
+    int integrator = 0;
+    std::vector<int> buf;
+};
+
+#endif // ROSETTABOY_BLIP_H
@@ -0,0 +1,141 @@
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <thread>
+
+#include "branch.h"
+#include "errors.h"
+
+namespace {
+    struct Child {
+        pid_t pid;
+        int fd;
+        int n;
+        std::vector<u8> out;
+    };
+
+    void write_all(int fd, const u8 *data, size_t len) {
+        while(len > 0) {
+            ssize_t n = write(fd, data, len);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return;
+            data += n;
+            len -= n;
+        }
+    }
+
+    /**
+     * Runs in the child. What we send back is one status byte (0 if `fn`
+     * returned, 1 if it threw) followed by whatever it returned, or the
+     * error message; and then we exit without running any destructors,
+     * since everything we'd be cleaning up belongs to the parent.
+     */
+    [[noreturn]] void run_child(GameBoy &gameboy, const BranchFn &fn, int n, int fd) {
+        u8 status = 0;
+        std::vector<u8> data;
+        try {
+            gameboy.detach();
+            data = fn(gameboy, n);
+        } catch(EmuException *e) {
+            std::string msg = e->what();
+            status = 1;
+            data.assign(msg.begin(), msg.end());
+        } catch(std::exception &e) {
+            std::string msg = e.what();
+            status = 1;
+            data.assign(msg.begin(), msg.end());
+        } catch(...) {
+            std::string msg = "unknown exception";
+            status = 1;
+            data.assign(msg.begin(), msg.end());
+        }
+        write_all(fd, &status, 1);
+        write_all(fd, data.data(), data.size());
+        close(fd);
+        fflush(nullptr);
+        _exit(0);
+    }
+
+    BranchResult finish(Child &child) {
+        close(child.fd);
+        int wstatus = 0;
+        while(waitpid(child.pid, &wstatus, 0) < 0 && errno == EINTR) {
+        }
+
+        BranchResult result;
+        if(WIFSIGNALED(wstatus)) {
+            result.error = std::string("killed by signal: ") + strsignal(WTERMSIG(wstatus));
+        } else if(child.out.empty()) {
+            result.error = "exited without a result";
+        } else if(child.out[0] == 0) {
+            result.data.assign(child.out.begin() + 1, child.out.end());
+        } else {
+            result.error.assign(child.out.begin() + 1, child.out.end());
+        }
+        return result;
+    }
+} // namespace
+
+std::vector<BranchResult> branch(GameBoy &gameboy, int count, const BranchFn &fn, int jobs) {
+    if(jobs <= 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<BranchResult> results(std::max(0, count));
+    std::vector<Child> running;
+    int next = 0;
+
+    // Anything still buffered would be written once by each child
+    fflush(nullptr);
+
+    while(next < count || !running.empty()) {
+        while(next < count && (int)running.size() < jobs) {
+            int fds[2];
+            if(pipe(fds) != 0) {
+                // Out of file descriptors - try again when a child finishes
+                if(!running.empty()) break;
+                throw new BranchFailed("pipe()", errno);
+            }
+            pid_t pid = fork();
+            if(pid < 0) {
+                int err = errno;
+                close(fds[0]);
+                close(fds[1]);
+                if(!running.empty()) break;
+                throw new BranchFailed("fork()", err);
+            }
+            if(pid == 0) {
+                close(fds[0]);
+                run_child(gameboy, fn, next, fds[1]);
+            }
+            close(fds[1]);
+            running.push_back({pid, fds[0], next++, {}});
+        }
+
+        // Children can only write so much into a pipe before they block,
+        // so read from whichever has something to say, rather than waiting
+        // for them in order
+        std::vector<pollfd> fds;
+        for(auto &child : running) fds.push_back({child.fd, POLLIN, 0});
+        if(poll(fds.data(), fds.size(), -1) < 0) {
+            if(errno == EINTR) continue;
+            throw new BranchFailed("poll()", errno);
+        }
+        for(size_t i = fds.size(); i-- > 0;) {
+            if(!fds[i].revents) continue;
+            Child &child = running[i];
+            u8 buf[64 * 1024];
+            ssize_t n = read(child.fd, buf, sizeof(buf));
+            if(n < 0 && errno == EINTR) continue;
+            if(n > 0) {
+                child.out.insert(child.out.end(), buf, buf + n);
+            } else {
+                results[child.n] = finish(child);
+                running.erase(running.begin() + i);
+            }
+        }
+    }
+    return results;
+}
@@ -0,0 +1,38 @@
+#ifndef ROSETTABOY_BRANCH_H
+#define ROSETTABOY_BRANCH_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "gameboy.h"
+
+struct BranchResult {
+    // Whatever the branch function returned
+    std::vector<u8> data;
+    // Empty if the branch function returned - otherwise what it threw,
+    // or what happened to the process running it
+    std::string error;
+};
+
+typedef std::function<std::vector<u8>(GameBoy &gameboy, int n)> BranchFn;
+
+/**
+ * Run `fn(gameboy, n)` for each n in [0, count), each on its own copy of
+ * `gameboy` as it is right now, and collect what each one returns - eg
+ * to try many different button sequences from one point in a game,
+ * without replaying everything up to that point for each of them.
+ *
+ * Each copy is a fork()ed child process, so it starts out sharing all
+ * of the parent's memory, and the OS only copies the pages which that
+ * branch writes to - typically a few pages of RAM, and the CPU and GPU
+ * state - rather than the whole machine. Children are detached from the
+ * parent's window, input and audio, and run headless and flat out. At
+ * most `jobs` run at once (0 = one per CPU core). `gameboy` itself isn't
+ * touched, so it can carry on or be branched again afterwards.
+ *
+ * POSIX only.
+ */
+std::vector<BranchResult> branch(GameBoy &gameboy, int count, const BranchFn &fn, int jobs = 0);
+
+#endif // ROSETTABOY_BRANCH_H
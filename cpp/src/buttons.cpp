@@ -5,19 +5,97 @@ Buttons::Buttons(CPU *cpu, bool headless) {
     if(!headless) SDL_InitSubSystem(SDL_INIT_GAMECONTROLLER);
     this->cpu = cpu;
     this->cycle = 0;
+    this->headless = headless;
 }
 
-void Buttons::tick() {
-    this->cycle++;
+Buttons::~Buttons() {
+    if(!this->headless) SDL_QuitSubSystem(SDL_INIT_GAMECONTROLLER);
+}
+
+/**
+ * Stop reading input events, leaving only set_buttons() - so that a
+ * forked copy of us doesn't take events meant for the parent
+ */
+void Buttons::detach() { this->detached = true; }
+
+void Buttons::tick(int cycles) {
+    this->cycle += cycles;
     this->update_buttons();
     if(this->cycle % 17556 == 20) {
-        if(this->handle_inputs()) {
+        bool need_interrupt = (!this->headless && !this->detached && this->handle_inputs()) || this->pressed;
+        this->pressed = false;
+        if(need_interrupt) {
             this->cpu->stop = false;
             this->cpu->interrupt(Interrupt::JOYPAD);
         }
     }
 }
 
+/**
+ * In between frames, update_buttons() only repeats itself (until
+ * the CPU writes to JOYP), so we only need to run once per frame,
+ * plus once more on the next cycle to publish the new inputs
+ */
+int Buttons::cycles_until_event() {
+    int frame_pos = this->cycle % 17556;
+    if(frame_pos < 20) return 20 - frame_pos;
+    if(frame_pos == 20) return 1;
+    return 17556 + 20 - frame_pos;
+}
+
+/**
+ * The buttons currently held, as a mask of Button bits
+ */
+u8 Buttons::get_buttons() {
+    return (this->a ? Button::A : 0) | (this->b ? Button::B : 0) | (this->select ? Button::SELECT : 0) |
+           (this->start ? Button::START : 0) | (this->right ? Button::RIGHT : 0) | (this->left ? Button::LEFT : 0) |
+           (this->up ? Button::UP : 0) | (this->down ? Button::DOWN : 0);
+}
+
+/**
+ * Set every button at once from a mask of Button bits, for when
+ * inputs come from a caller rather than from SDL. Like a key press,
+ * pressing a new button wakes the CPU at the start of the next frame.
+ */
+void Buttons::set_buttons(u8 mask) {
+    if(mask & ~this->get_buttons()) this->pressed = true;
+
+    this->a = mask & Button::A;
+    this->b = mask & Button::B;
+    this->select = mask & Button::SELECT;
+    this->start = mask & Button::START;
+    this->right = mask & Button::RIGHT;
+    this->left = mask & Button::LEFT;
+    this->up = mask & Button::UP;
+    this->down = mask & Button::DOWN;
+}
+
+void Buttons::save_state(StateWriter *out) {
+    out->put(this->cycle);
+    out->put(this->up);
+    out->put(this->down);
+    out->put(this->left);
+    out->put(this->right);
+    out->put(this->a);
+    out->put(this->b);
+    out->put(this->start);
+    out->put(this->select);
+    out->put(this->pressed);
+}
+
+void Buttons::load_state(StateReader *in) {
+    in->get(this->cycle);
+    in->get(this->up);
+    in->get(this->down);
+    in->get(this->left);
+    in->get(this->right);
+    in->get(this->a);
+    in->get(this->b);
+    in->get(this->start);
+    in->get(this->select);
+    in->get(this->pressed);
+}
+
 void Buttons::update_buttons() {
     u8 JOYP = ~this->cpu->ram->get(Mem::JOYP);
     JOYP &= 0x30;
@@ -53,6 +131,10 @@ bool Buttons::handle_inputs() {
                     this->turbo = true;
                     need_interrupt = false;
                     break;
+                case SDLK_BACKSPACE:
+                    this->rewinding = true;
+                    need_interrupt = false;
+                    break;
                 case SDLK_UP: this->up = true; break;
                 case SDLK_DOWN: this->down = true; break;
                 case SDLK_LEFT: this->left = true; break;
@@ -67,6 +149,7 @@ bool Buttons::handle_inputs() {
         if(event.type == SDL_KEYUP) {
             switch(event.key.keysym.sym) {
                 case SDLK_LSHIFT: this->turbo = false; break;
+                case SDLK_BACKSPACE: this->rewinding = false; break;
                 case SDLK_UP: this->up = false; break;
                 case SDLK_DOWN: this->down = false; break;
                 case SDLK_LEFT: this->left = false; break;
@@ -19,9 +19,22 @@ namespace Joypad {
     const u8 A = 1 << 0;
 } // namespace Joypad
 
+// Bits for Buttons::set_buttons(), in the same order as the hardware
+// reports them (buttons in the low nibble, d-pad in the high nibble)
+namespace Button {
+    const u8 A = 1 << 0;
+    const u8 B = 1 << 1;
+    const u8 SELECT = 1 << 2;
+    const u8 START = 1 << 3;
+    const u8 RIGHT = 1 << 4;
+    const u8 LEFT = 1 << 5;
+    const u8 UP = 1 << 6;
+    const u8 DOWN = 1 << 7;
+} // namespace Button
+
 class Buttons {
 private:
-    u32 cycle = 0;
+    uint64_t cycle = 0;
     CPU *cpu = nullptr;
     bool up = false;
     bool down = false;
@@ -31,11 +44,22 @@ private:
     bool b = false;
     bool start = false;
     bool select = false;
+    bool pressed = false;
+    bool headless = true;
+    bool detached = false;
 
 public:
     Buttons(CPU *cpu, bool headless);
-    void tick();
+    ~Buttons();
+    void tick(int cycles);
+    int cycles_until_event();
+    u8 get_buttons();
+    void set_buttons(u8 mask);
+    void detach();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
     bool turbo = false;
+    bool rewinding = false;
 
 private:
     bool handle_inputs();
@@ -4,6 +4,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 #include "cart.h"
 #include "consts.h"
@@ -24,7 +25,11 @@ u32 parse_ram_size(u8 val) {
     }
 }
 
-Cart::Cart(std::string filename) {
+/**
+ * If `save` is set, cart RAM is backed by a .sav file next to the ROM,
+ * otherwise it starts out empty and is thrown away at the end
+ */
+Cart::Cart(std::string filename, bool save) {
     struct stat statbuf;
     int statok = stat(filename.c_str(), &statbuf);
     if(statok < 0) {
@@ -36,7 +41,9 @@ Cart::Cart(std::string filename) {
     if(fd < 0) {
         throw new RomMissing(filename, errno);
     }
-    this->data = (unsigned char *)mmap(nullptr, (size_t)statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    this->data_len = (size_t)statbuf.st_size;
+    this->data = (unsigned char *)mmap(nullptr, this->data_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
 
     memcpy(this->logo, this->data + 0x0104, 48);
     memcpy(this->name, this->data + 0x0134, 16);
@@ -68,7 +75,10 @@ Cart::Cart(std::string filename) {
         throw new HeaderChecksumFailed(header_checksum);
     }
 
-    if(this->ram_size) {
+    if(this->ram_size && !save) {
+        this->ram = (unsigned char *)mmap(nullptr, (size_t)this->ram_size, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else if(this->ram_size) {
         std::string fn2 = filename;
         fn2.replace(fn2.end() - 2, fn2.end(), "sav");
         int ram_fd = open(fn2.c_str(), O_RDWR | O_CREAT, 0600);
@@ -80,6 +90,7 @@ Cart::Cart(std::string filename) {
         }
         this->ram =
             (unsigned char *)mmap(nullptr, (size_t)this->ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, ram_fd, 0);
+        close(ram_fd);
     }
 
     if(debug) {
@@ -97,3 +108,23 @@ Cart::Cart(std::string filename) {
         printf("checksum     : %d\n", checksum);
     }
 }
+
+/**
+ * Swap the .sav-backed cart RAM (which fork() shares rather than copies)
+ * for a private copy at the same address, so that RAM's page pointers
+ * stay valid - for a copy of the cart in a branch, whose writes mustn't
+ * reach the parent, its siblings, or the .sav
+ */
+void Cart::detach() {
+    if(!this->ram) return;
+    std::vector<u8> copy(this->ram, this->ram + this->ram_size);
+    void *ram = mmap(this->ram, (size_t)this->ram_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if(ram == MAP_FAILED) throw new RomMissing("cart RAM", errno);
+    memcpy(this->ram, copy.data(), copy.size());
+}
+
+Cart::~Cart() {
+    munmap(this->data, this->data_len);
+    if(this->ram) munmap(this->ram, this->ram_size);
+}
@@ -53,10 +53,13 @@ public:
     u8 complement_check;
     u16 checksum;
 
-    Cart(std::string filename);
+    Cart(std::string filename, bool save);
+    ~Cart();
+    void detach();
 
 private:
     bool debug = false;
+    size_t data_len = 0;
 };
 
 #endif // ROSETTABOY_CART_H
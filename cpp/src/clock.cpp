@@ -8,8 +8,8 @@ Clock::Clock(Buttons *buttons, int frames, int profile, bool turbo) {
     this->turbo = turbo;
 }
 
-void Clock::tick() {
-    this->cycle++;
+void Clock::tick(int cycles) {
+    this->cycle += cycles;
 
     // Do a whole frame's worth of sleeping at the start of each frame
     if(this->cycle % 17556 == 20) {
@@ -29,4 +29,30 @@ void Clock::tick() {
 
         this->frame++;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * The only thing we do is once per frame, so we can skip
+ * straight to the start of the next frame
+ */
+int Clock::cycles_until_event() {
+    int frame_pos = this->cycle % 17556;
+    return frame_pos < 20 ? 20 - frame_pos : 17556 + 20 - frame_pos;
+}
+/**
+ * Run flat out, and never time out - once detached, we're a branch
+ * being driven by a search, which decides for itself when to stop
+ */
+void Clock::detach() {
+    this->turbo = true;
+    this->frames = 0;
+    this->profile = 0;
+}
+
+/**
+ * Only the position within the frame is part of the emulated machine -
+ * frame counts and timings are about this run of the emulator
+ */
+void Clock::save_state(StateWriter *out) { out->put(this->cycle); }
+
+void Clock::load_state(StateReader *in) { in->get(this->cycle); }
@@ -5,11 +5,12 @@
 
 #include "buttons.h"
 #include "consts.h"
+#include "state.h"
 
 class Clock {
 private:
     Buttons *buttons = nullptr;
-    int cycle = 0;
+    uint64_t cycle = 0;
     int frame = 0;
     int last_frame_start = SDL_GetTicks();
     int start = SDL_GetTicks();
@@ -19,8 +20,11 @@ private:
 
 public:
     Clock(Buttons *buttons, int frames, int profile, bool turbo);
-    ~Clock();
-    void tick();
+    void tick(int cycles);
+    int cycles_until_event();
+    void detach();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
 };
 
 #endif // ROSETTABOY_CLOCK_H
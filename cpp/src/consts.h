@@ -63,6 +63,7 @@ namespace Mem {
     const u16 NR50 = 0xFF24;
     const u16 NR51 = 0xFF25;
     const u16 NR52 = 0xFF26;
+    const u16 WAVE = 0xFF30; // 16 bytes, up to 0xFF3F
 
     const u16 LCDC = 0xFF40;
     const u16 STAT = 0xFF41;
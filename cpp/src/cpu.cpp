@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 
 #include "consts.h"
@@ -19,12 +20,21 @@ CPU::CPU(RAM *ram, bool debug) {
     this->HL = 0x0000;
     this->SP = 0x0000;
     this->PC = 0x0000;
+    this->flags_written();
+
+    this->timer = std::make_unique<Timer>(this);
+#ifdef ENABLE_JIT
+    this->jit = std::make_unique<JIT>(this, debug);
+#endif
 }
 
 void CPU::dump_regs() {
     // stack
     u16 sp_val = this->ram->get(this->SP) | this->ram->get(this->SP + 1) << 8;
 
+    // flags
+    this->flags();
+
     // interrupts
     u8 IE = this->ram->get(Mem::IE);
     u8 IF = this->ram->get(Mem::IF);
@@ -65,6 +75,36 @@ void CPU::dump_regs() {
     // clang-format on
 }
 
+void CPU::save_state(StateWriter *out) {
+    out->put(this->AF);
+    out->put(this->BC);
+    out->put(this->DE);
+    out->put(this->HL);
+    out->put(this->SP);
+    out->put(this->PC);
+    out->put(this->lazy);
+    out->put(this->interrupts);
+    out->put(this->halt);
+    out->put(this->stop);
+    out->put(this->owed_cycles);
+    this->timer->save_state(out);
+}
+
+void CPU::load_state(StateReader *in) {
+    in->get(this->AF);
+    in->get(this->BC);
+    in->get(this->DE);
+    in->get(this->HL);
+    in->get(this->SP);
+    in->get(this->PC);
+    in->get(this->lazy);
+    in->get(this->interrupts);
+    in->get(this->halt);
+    in->get(this->stop);
+    in->get(this->owed_cycles);
+    this->timer->load_state(in);
+}
+
 /**
  * Set a given interrupt bit - on the next tick, if the interrupt
  * handler for this interrupt is enabled (and interrupts in general
@@ -75,13 +115,371 @@ void CPU::interrupt(Interrupt::Interrupt i) {
     this->halt = false; // interrupts interrupt HALT state
 }
 
-void CPU::tick() {
-    this->tick_dma();
-    this->tick_clock();
-    this->tick_interrupts();
-    if(this->halt) return;
-    if(this->stop) return;
-    this->tick_instructions();
+/**
+ * Run for up to `cycles` cycles, stopping early if we write to a
+ * register that another subsystem is watching. Returns the number
+ * of cycles that were actually run.
+ *
+ * The main loop is compiled twice, once with the debug output and
+ * once without, so that the non-debug version doesn't need to check
+ * whether or not to print a trace before every instruction. (Building
+ * with ENABLE_DEBUG_SPECIALISATION=Off always checks at runtime, which
+ * is only useful for benchmarking the difference.)
+ */
+int CPU::tick(int cycles) {
+#ifdef ENABLE_DEBUG_SPECIALISATION
+    int ran = this->debug ? this->tick_cycles<true>(cycles) : this->tick_cycles<false>(cycles);
+#else
+    int ran = this->tick_cycles<true>(cycles);
+#endif
+    // Leave the timer's registers up to date for everybody else
+    this->timer->sync();
+    return ran;
+}
+
+/**
+ * With ENABLE_COMPUTED_GOTO, every instruction handler ends by fetching
+ * the next opcode and jumping straight to its handler, rather than going
+ * back around to a single `switch` - this gives the branch predictor one
+ * indirect jump per handler to learn from instead of one for everything
+ * (eg "after CP, we usually JR NZ"). Without it (or with a compiler that
+ * doesn't support labels-as-values), the same handlers are compiled as
+ * a plain `switch`.
+ */
+#ifdef ENABLE_COMPUTED_GOTO
+#define DISPATCH goto *handlers[op];
+#define OP(n) op_##n
+#define OP_RANGE(first, last) op_##first##_##last
+#define OP_INVALID op_invalid
+#define NEXT                                                                                                           \
+    if(!this->catch_up<debug_cpu>(ran, cycles)) return ran;                                                            \
+    op = this->fetch<debug_cpu>(arg);                                                                                  \
+    goto *handlers[op]
+#else
+#define DISPATCH switch(op)
+#define OP(n) case 0x##n
+#define OP_RANGE(first, last) case 0x##first ... 0x##last
+#define OP_INVALID default
+#define NEXT break
+#endif
+
+template <bool debug_cpu> int CPU::tick_cycles(int cycles) {
+    int ran = 0;
+    u8 op = 0, carry = 0;
+    u16 val16 = 0;
+    oparg arg;
+
+#ifdef ENABLE_COMPUTED_GOTO
+    // clang-format off
+    static const void *const handlers[256] = {
+        &&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+        &&op_08, &&op_09, &&op_0A, &&op_0B, &&op_0C, &&op_0D, &&op_0E, &&op_0F,
+        &&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+        &&op_18, &&op_19, &&op_1A, &&op_1B, &&op_1C, &&op_1D, &&op_1E, &&op_1F,
+        &&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+        &&op_28, &&op_29, &&op_2A, &&op_2B, &&op_2C, &&op_2D, &&op_2E, &&op_2F,
+        &&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+        &&op_38, &&op_39, &&op_3A, &&op_3B, &&op_3C, &&op_3D, &&op_3E, &&op_3F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F, &&op_40_7F,
+        &&op_80_87, &&op_80_87, &&op_80_87, &&op_80_87, &&op_80_87, &&op_80_87, &&op_80_87, &&op_80_87,
+        &&op_88_8F, &&op_88_8F, &&op_88_8F, &&op_88_8F, &&op_88_8F, &&op_88_8F, &&op_88_8F, &&op_88_8F,
+        &&op_90_97, &&op_90_97, &&op_90_97, &&op_90_97, &&op_90_97, &&op_90_97, &&op_90_97, &&op_90_97,
+        &&op_98_9F, &&op_98_9F, &&op_98_9F, &&op_98_9F, &&op_98_9F, &&op_98_9F, &&op_98_9F, &&op_98_9F,
+        &&op_A0_A7, &&op_A0_A7, &&op_A0_A7, &&op_A0_A7, &&op_A0_A7, &&op_A0_A7, &&op_A0_A7, &&op_A0_A7,
+        &&op_A8_AF, &&op_A8_AF, &&op_A8_AF, &&op_A8_AF, &&op_A8_AF, &&op_A8_AF, &&op_A8_AF, &&op_A8_AF,
+        &&op_B0_B7, &&op_B0_B7, &&op_B0_B7, &&op_B0_B7, &&op_B0_B7, &&op_B0_B7, &&op_B0_B7, &&op_B0_B7,
+        &&op_B8_BF, &&op_B8_BF, &&op_B8_BF, &&op_B8_BF, &&op_B8_BF, &&op_B8_BF, &&op_B8_BF, &&op_B8_BF,
+        &&op_C0, &&op_C1, &&op_C2, &&op_C3, &&op_C4, &&op_C5, &&op_C6, &&op_C7,
+        &&op_C8, &&op_C9, &&op_CA, &&op_CB, &&op_CC, &&op_CD, &&op_CE, &&op_CF,
+        &&op_D0, &&op_D1, &&op_D2, &&op_invalid, &&op_D4, &&op_D5, &&op_D6, &&op_D7,
+        &&op_D8, &&op_D9, &&op_DA, &&op_invalid, &&op_DC, &&op_invalid, &&op_DE, &&op_DF,
+        &&op_E0, &&op_E1, &&op_E2, &&op_invalid, &&op_invalid, &&op_E5, &&op_E6, &&op_E7,
+        &&op_E8, &&op_E9, &&op_EA, &&op_invalid, &&op_invalid, &&op_invalid, &&op_EE, &&op_EF,
+        &&op_F0, &&op_F1, &&op_F2, &&op_F3, &&op_invalid, &&op_F5, &&op_F6, &&op_F7,
+        &&op_F8, &&op_F9, &&op_FA, &&op_FB, &&op_FC, &&op_FD, &&op_FE, &&op_FF,
+    };
+    // clang-format on
+#endif
+
+    while(this->catch_up<debug_cpu>(ran, cycles)) {
+        op = this->fetch<debug_cpu>(arg);
+        DISPATCH {
+            // clang-format off
+            OP(00): /* NOP */; NEXT;
+            OP(01): this->BC = arg.as_u16; NEXT;
+            OP(02): this->ram->set(this->BC, this->A); NEXT;
+            OP(03): this->BC++; NEXT;
+            OP(08):
+                this->ram->set(arg.as_u16+1, ((this->SP >> 8) & 0xFF));
+                this->ram->set(arg.as_u16, (this->SP & 0xFF));
+                NEXT;  // how does this fit?
+            OP(0A): this->A = this->ram->get(this->BC); NEXT;
+            OP(0B): this->BC--; NEXT;
+
+            OP(10): this->stop = true; NEXT;
+            OP(11): this->DE = arg.as_u16; NEXT;
+            OP(12): this->ram->set(this->DE, this->A); NEXT;
+            OP(13): this->DE++; NEXT;
+            OP(18): this->PC += arg.as_i8; NEXT;
+            OP(1A): this->A = this->ram->get(this->DE); NEXT;
+            OP(1B): this->DE--; NEXT;
+
+            OP(20): if(!this->flag_z()) this->PC += arg.as_i8; NEXT;
+            OP(21): this->HL = arg.as_u16; NEXT;
+            OP(22): this->ram->set(this->HL++, this->A); NEXT;
+            OP(23): this->HL++; NEXT;
+            OP(27):
+                this->flags();
+                val16 = this->A;
+                if(this->FLAG_N == 0) {
+                    if (this->FLAG_H || (val16 & 0x0F) > 9) val16 += 6;
+                    if (this->FLAG_C || val16 > 0x9F) val16 += 0x60;
+                }
+                else {
+                    if(this->FLAG_H) {
+                        val16 -= 6;
+                        if (this->FLAG_C == 0) val16 &= 0xFF;
+                    }
+                    if(this->FLAG_C) val16 -= 0x60;
+                }
+                this->FLAG_H = false;
+                if(val16 & 0x100) this->FLAG_C = true;
+                this->A = val16 & 0xFF;
+                this->FLAG_Z = this->A == 0;
+                this->flags_written();
+                NEXT;
+            OP(28): if(this->flag_z()) this->PC += arg.as_i8; NEXT;
+            OP(2A): this->A = this->ram->get(this->HL++); NEXT;
+            OP(2B): this->HL--; NEXT;
+            OP(2F): this->flags(); this->A ^= 0xFF; this->FLAG_N = true; this->FLAG_H = true; NEXT;
+
+            OP(30): if(!this->flag_c()) this->PC += arg.as_i8; NEXT;
+            OP(31): this->SP = arg.as_u16; NEXT;
+            OP(32): this->ram->set(this->HL--, this->A); NEXT;
+            OP(33): this->SP++; NEXT;
+            OP(37): this->flags(); this->FLAG_N = false; this->FLAG_H = false; this->FLAG_C = true; this->flags_written(); NEXT;
+            OP(38): if(this->flag_c()) this->PC += arg.as_i8; NEXT;
+            OP(3A): this->A = this->ram->get(this->HL--); NEXT;
+            OP(3B): this->SP--; NEXT;
+            OP(3F): this->flags(); this->FLAG_C = !this->FLAG_C; this->FLAG_N = false; this->FLAG_H = false; this->flags_written(); NEXT;
+
+            OP(04): OP(0C): // INC r
+            OP(14): OP(1C):
+            OP(24): OP(2C):
+            OP(34): OP(3C):
+                this->set_reg((op-0x04)/8, this->_inc(this->get_reg((op-0x04)/8)));
+                NEXT;
+
+            OP(05): OP(0D): // DEC r
+            OP(15): OP(1D):
+            OP(25): OP(2D):
+            OP(35): OP(3D):
+                this->set_reg((op-0x05)/8, this->_dec(this->get_reg((op-0x05)/8)));
+                NEXT;
+
+            OP(06): OP(0E): // LD r,n
+            OP(16): OP(1E):
+            OP(26): OP(2E):
+            OP(36): OP(3E):
+                this->set_reg((op-0x06)/8, arg.as_u8);
+                NEXT;
+
+            OP(07): // RCLA
+            OP(17): // RLA
+            OP(0F): // RRCA
+            OP(1F): // RRA
+                carry = this->flags() & (1 << 4) ? 1 : 0;
+                if(op == 0x07) { // RCLA
+                    this->FLAG_C = (this->A & (1 << 7)) != 0;
+                    this->A = (this->A << 1) | (this->A >> 7);
+                }
+                if(op == 0x17) { // RLA
+                    this->FLAG_C = (this->A & (1 << 7)) != 0;
+                    this->A = (this->A << 1) | carry;
+                }
+                if(op == 0x0F) { // RRCA
+                    this->FLAG_C = (this->A & (1 << 0)) != 0;
+                    this->A = (this->A >> 1) | (this->A << 7);
+                }
+                if(op == 0x1F) { // RRA
+                    this->FLAG_C = (this->A & (1 << 0)) != 0;
+                    this->A = (this->A >> 1) | (carry << 7);
+                }
+                this->FLAG_N = false;
+                this->FLAG_H = false;
+                this->FLAG_Z = false;
+                this->flags_written();
+                NEXT;
+
+            OP(09): // ADD HL,rr
+            OP(19):
+            OP(29):
+            OP(39):
+                if(op == 0x09) val16 = this->BC;
+                if(op == 0x19) val16 = this->DE;
+                if(op == 0x29) val16 = this->HL;
+                if(op == 0x39) val16 = this->SP;
+                this->flags();
+                this->FLAG_H = ((this->HL & 0x0FFF) + (val16 & 0x0FFF) > 0x0FFF);
+                this->FLAG_C = (this->HL + val16 > 0xFFFF);
+                this->HL += val16;
+                this->FLAG_N = false;
+                this->flags_written();
+                NEXT;
+
+            OP_RANGE(40, 7F): // LD r,r
+                if(op == 0x76) {
+                    // FIXME: weird timing side effects
+                    this->halt = true;
+                } else {
+                    this->set_reg((op - 0x40)>>3, this->get_reg(op - 0x40));
+                }
+                NEXT;
+
+            OP_RANGE(80, 87): this->_add(this->get_reg(op)); NEXT;
+            OP_RANGE(88, 8F): this->_adc(this->get_reg(op)); NEXT;
+            OP_RANGE(90, 97): this->_sub(this->get_reg(op)); NEXT;
+            OP_RANGE(98, 9F): this->_sbc(this->get_reg(op)); NEXT;
+            OP_RANGE(A0, A7): this->_and(this->get_reg(op)); NEXT;
+            OP_RANGE(A8, AF): this->_xor(this->get_reg(op)); NEXT;
+            OP_RANGE(B0, B7): this->_or(this->get_reg(op)); NEXT;
+            OP_RANGE(B8, BF): this->_cp(this->get_reg(op)); NEXT;
+        
+            OP(C0): if(!this->flag_z()) this->PC = this->pop(); NEXT;
+            OP(C1): this->BC = this->pop(); NEXT;
+            OP(C2): if(!this->flag_z()) this->PC = arg.as_u16; NEXT;
+            OP(C3): this->PC = arg.as_u16; NEXT;
+            OP(C4): if(!this->flag_z()) {this->push(this->PC); this->PC = arg.as_u16;} NEXT;
+            OP(C5): this->push(this->BC); NEXT;
+            OP(C6): this->_add(arg.as_u8); NEXT;
+            OP(C7): this->push(this->PC); this->PC = 0x00; NEXT;
+            OP(C8): if(this->flag_z()) this->PC = this->pop(); NEXT;
+            OP(C9): this->PC = this->pop(); NEXT;
+            OP(CA): if(this->flag_z()) this->PC = arg.as_u16; NEXT;
+            OP(CB): this->tick_cb(arg.as_u8); NEXT;
+            OP(CC): if(this->flag_z()) {this->push(this->PC); this->PC = arg.as_u16;} NEXT;
+            OP(CD): this->push(this->PC); this->PC = arg.as_u16; NEXT;
+            OP(CE): this->_adc(arg.as_u8); NEXT;
+            OP(CF): this->push(this->PC); this->PC = 0x08; NEXT;
+
+            OP(D0): if(!this->flag_c()) this->PC = this->pop(); NEXT;
+            OP(D1): this->DE = this->pop(); NEXT;
+            OP(D2): if(!this->flag_c()) this->PC = arg.as_u16; NEXT;
+            // OP(D3): NEXT;
+            OP(D4): if(!this->flag_c()) {this->push(this->PC); this->PC = arg.as_u16;} NEXT;
+            OP(D5): this->push(this->DE); NEXT;
+            OP(D6): this->_sub(arg.as_u8); NEXT;
+            OP(D7): this->push(this->PC); this->PC = 0x10; NEXT;
+            OP(D8): if(this->flag_c()) this->PC = this->pop(); NEXT;
+            OP(D9): this->PC = this->pop(); this->interrupts = true; NEXT;
+            OP(DA): if(this->flag_c()) this->PC = arg.as_u16; NEXT;
+            // OP(DB): NEXT;
+            OP(DC): if(this->flag_c()) {this->push(this->PC); this->PC = arg.as_u16;} NEXT;
+            // OP(DD): NEXT;
+            OP(DE): this->_sbc(arg.as_u8); NEXT;
+            OP(DF): this->push(this->PC); this->PC = 0x18; NEXT;
+
+            OP(E0): this->ram->set(0xFF00 + arg.as_u8, this->A); if(arg.as_u8 == 0x01 && this->print_serial) {putchar(this->A);}; NEXT;
+            OP(E1): this->HL = this->pop(); NEXT;
+            OP(E2): this->ram->set(0xFF00 + this->C, this->A); if(this->C == 0x01 && this->print_serial) {putchar(this->A);}; NEXT;
+            // OP(E3): NEXT;
+            // OP(E4): NEXT;
+            OP(E5): this->push(this->HL); NEXT;
+            OP(E6): this->_and(arg.as_u8); NEXT;
+            OP(E7): this->push(this->PC); this->PC = 0x20; NEXT;
+            OP(E8):
+                val16 = this->SP + arg.as_i8;
+                //this->FLAG_H = ((this->SP & 0x0FFF) + (arg.as_i8 & 0x0FFF) > 0x0FFF);
+                //this->FLAG_C = (this->SP + arg.as_i8 > 0xFFFF);
+                this->FLAG_H = ((this->SP ^ arg.as_i8 ^ val16) & 0x10 ? true : false);
+                this->FLAG_C = ((this->SP ^ arg.as_i8 ^ val16) & 0x100 ? true : false);
+                this->SP += arg.as_i8;
+                this->FLAG_Z = false;
+                this->FLAG_N = false;
+                this->flags_written();
+                NEXT;
+            OP(E9): this->PC = this->HL; NEXT;
+            OP(EA): this->ram->set(arg.as_u16, this->A); NEXT;
+            // OP(EB): NEXT;
+            // OP(EC): NEXT;
+            // OP(ED): NEXT;
+            OP(EE): this->_xor(arg.as_u8); NEXT;
+            OP(EF): this->push(this->PC); this->PC = 0x28; NEXT;
+
+            OP(F0): this->A = this->ram->get(0xFF00 + arg.as_u8); NEXT;
+            OP(F1): this->AF = (this->pop() & 0xFFF0); this->flags_written(); NEXT;
+            OP(F2): this->A = this->ram->get(0xFF00 + this->C); NEXT;
+            OP(F3): this->interrupts = false; NEXT;
+            // OP(F4): NEXT;
+            OP(F5): this->flags(); this->push(this->AF); NEXT;
+            OP(F6): this->_or(arg.as_u8); NEXT;
+            OP(F7): this->push(this->PC); this->PC = 0x30; NEXT;
+            OP(F8):
+                if(arg.as_i8 >= 0) {
+                    this->FLAG_C = ((this->SP & 0xFF) + (arg.as_i8 & 0xFF)) > 0xFF;
+                    this->FLAG_H = ((this->SP & 0x0F) + (arg.as_i8 & 0x0F)) > 0x0F;
+                } else {
+                    this->FLAG_C = ((this->SP + arg.as_i8) & 0xFF) <= (this->SP & 0xFF);
+                    this->FLAG_H = ((this->SP + arg.as_i8) & 0x0F) <= (this->SP & 0x0F);
+                }
+                // this->FLAG_H = ((((this->SP & 0x0f) + (arg.as_u8 & 0x0f)) & 0x10) != 0);
+                // this->FLAG_C = ((((this->SP & 0xff) + (arg.as_u8 & 0xff)) & 0x100) != 0);
+                this->HL = this->SP + arg.as_i8;
+                this->FLAG_Z = false;
+                this->FLAG_N = false;
+                this->flags_written();
+                NEXT;
+            OP(F9): this->SP = this->HL; NEXT;
+            OP(FA): this->A = this->ram->get(arg.as_u16); NEXT;
+            OP(FB): this->interrupts = true; NEXT;
+            OP(FC): throw new UnitTestPassed(); // unofficial
+            OP(FD): throw new UnitTestFailed(); // unofficial
+            OP(FE): this->_cp(arg.as_u8); NEXT;
+            OP(FF): this->push(this->PC); this->PC = 0x38; NEXT;
+
+            // missing ops
+            OP_INVALID: throw new InvalidOpcode(op);
+            // clang-format on
+        }
+    }
+    return ran;
+}
+
+#undef DISPATCH
+#undef OP
+#undef OP_RANGE
+#undef OP_INVALID
+#undef NEXT
+
+/**
+ * If the previous instruction was large, let's not run any more
+ * instructions until other subsystems have caught up.
+ *
+ * While we wait, DMA can only be started by the instruction itself,
+ * and the interrupt registers can only be changed by the timer (which
+ * sets sync_needed when it does) - so after the first cycle, we can
+ * skip ahead to the next timer interrupt, or the end of the wait.
+ */
+template <bool debug_cpu> int CPU::tick_owed(int cycles) {
+    int n = std::min(this->owed_cycles, cycles);
+    int i = 0;
+    while(i < n) {
+        int step = i == 0 ? 1 : std::min(n - i, this->timer->cycles_until_interrupt());
+        if(i == 0) this->tick_dma();
+        this->timer->tick(step);
+        if(i == 0 || this->ram->sync_needed) this->tick_interrupts<debug_cpu>();
+        i += step;
+        if(this->ram->sync_needed) break;
+    }
+    this->owed_cycles -= i;
+    return i;
 }
 
 /**
@@ -99,30 +497,6 @@ void CPU::tick_dma() {
     }
 }
 
-/**
- * Increment the timer registers, and send an interrupt
- * when TIMA wraps around.
- */
-void CPU::tick_clock() {
-    cycle++;
-
-    // TODO: writing any value to Mem::DIV should reset it to 0x00
-    // increment at 16384Hz (each 64 cycles?)
-    if(cycle % 64 == 0) this->ram->set(Mem::DIV, this->ram->get(Mem::DIV) + 1);
-
-    if(this->ram->get(Mem::TAC) & (1 << 2)) { // timer enable
-        u16 speeds[] = {256, 4, 16, 64};      // increment per X cycles
-        u16 speed = speeds[this->ram->get(Mem::TAC) & 0x03];
-        if(cycle % speed == 0) {
-            if(this->ram->get(Mem::TIMA) == 0xFF) {
-                this->ram->set(Mem::TIMA, this->ram->get(Mem::TMA)); // if timer overflows, load base
-                this->interrupt(Interrupt::TIMER);
-            }
-            this->ram->set(Mem::TIMA, this->ram->get(Mem::TIMA) + 1);
-        }
-    }
-}
-
 bool CPU::check_interrupt(u8 queue, u8 i, u16 handler) {
     if(queue & i) {
         // TODO: wait two cycles
@@ -131,6 +505,7 @@ bool CPU::check_interrupt(u8 queue, u8 i, u16 handler) {
         this->push(this->PC);
         this->PC = handler;
         this->ram->set(Mem::IF, this->ram->get(Mem::IF) & ~i);
+        STAT(this->counts.interrupts++);
         return true;
     }
     return false;
@@ -141,10 +516,11 @@ bool CPU::check_interrupt(u8 queue, u8 i, u16 handler) {
  * there are any interrupts which are both enabled and flagged,
  * clear the flag and call the handler for the first of them.
  */
-void CPU::tick_interrupts() {
+template <bool debug_cpu> void CPU::tick_interrupts() {
     u8 queue = this->ram->get(Mem::IE) & this->ram->get(Mem::IF);
     if(this->interrupts && queue) {
-        if(debug) printf("Handling interrupts: %02X & %02X\n", this->ram->get(Mem::IE), this->ram->get(Mem::IF));
+        if(debug_cpu && this->debug)
+            printf("Handling interrupts: %02X & %02X\n", this->ram->get(Mem::IE), this->ram->get(Mem::IF));
         this->interrupts = false; // no nested interrupts, RETI will re-enable
         this->check_interrupt(queue, Interrupt::VBLANK, Mem::VBLANK_HANDLER) ||
             this->check_interrupt(queue, Interrupt::STAT, Mem::LCD_HANDLER) ||
@@ -155,298 +531,121 @@ void CPU::tick_interrupts() {
 }
 
 /**
- * Pick an instruction from RAM as pointed to by the
- * Program Counter register; if the instruction takes
- * an argument then pick that too; then execute it.
+ * Let DMA, the timer and interrupts catch up with the previous
+ * instruction - returns true once it's time to fetch the next one,
+ * or false if we run out of cycles first.
  */
-void CPU::tick_instructions() {
-    // if the previous instruction was large, let's not run any
-    // more instructions until other subsystems have caught up
-    if(owed_cycles) {
-        owed_cycles--;
-        return;
+template <bool debug_cpu> bool CPU::catch_up(int &ran, int cycles) {
+    while(ran < cycles && !this->ram->sync_needed) {
+        if(this->owed_cycles) {
+            ran += this->tick_owed<debug_cpu>(cycles - ran);
+            continue;
+        }
+        this->tick_dma();
+        this->timer->tick(1);
+        this->tick_interrupts<debug_cpu>();
+        ran++;
+        if(this->halt || this->stop) {
+            // Only an interrupt can wake us up, and until the end of this
+            // budget only the timer can raise one - so jump straight to
+            // the cycle where it would, without ticking every cycle
+            int skip = std::min(cycles - ran, this->timer->cycles_until_interrupt() - 1);
+            if(skip > 0) {
+                this->timer->tick(skip);
+                ran += skip;
+            }
+            continue;
+        }
+#ifdef ENABLE_JIT
+        if(this->PC != this->fallthrough) {
+            int jitted = this->jit->run(cycles - ran);
+            if(jitted) {
+                STAT(this->counts.jit_blocks++);
+                this->owed_cycles = jitted - 1;
+                continue;
+            }
+        }
+#endif
+        // The instruction might look at the timer's registers
+        this->timer->sync();
+        return true;
     }
+    return false;
+}
 
-    if(this->debug) {
+/**
+ * Pick an instruction from RAM as pointed to by the
+ * Program Counter register; if the instruction takes
+ * an argument then pick that too.
+ *
+ * Instructions in ROM only need decoding once, so we keep
+ * them decoded, indexed by where they are in the cart (not
+ * by address, so switching banks doesn't invalidate them).
+ * Code running from RAM can change, so is decoded each time.
+ */
+template <bool debug_cpu> inline u8 CPU::fetch(oparg &arg) {
+    if(debug_cpu && this->debug) {
         this->dump_regs();
     }
 
-    u8 op = this->ram->get(this->PC);
-    if(op == 0xCB) {
-        op = this->ram->get(this->PC + 1);
-        this->PC += 2;
-        this->tick_cb(op);
-        owed_cycles = OP_CB_CYCLES[op];
-    } else {
-        oparg arg;
-        arg.as_u16 = 0xCA75;
-        u8 arg_len = OP_ARG_BYTES[OP_ARG_TYPES[op]];
-        if(arg_len == 1) {
-            arg.as_u8 = this->ram->get(this->PC + 1);
-        }
-        if(arg_len == 2) {
-            u16 low = this->ram->get(this->PC + 1);
-            u16 high = this->ram->get(this->PC + 2);
-            arg.as_u16 = high << 8 | low;
+    STAT(this->counts.instructions++);
+    Decoded ins;
+    int offset = this->ram->rom_offset(this->PC);
+    if(offset >= 0) {
+        Decoded *bank = this->decoded[offset / ROM_BANK_SIZE].get();
+        if(bank && bank[offset % ROM_BANK_SIZE].len) {
+            ins = bank[offset % ROM_BANK_SIZE];
+        } else {
+            ins = this->decode_rom(offset);
         }
-        this->PC += 1 + arg_len;
-        this->tick_main(op, arg);
-        owed_cycles = OP_CYCLES[op];
+    } else {
+        ins = this->decode(this->PC);
+    }
+    arg = ins.arg;
+    this->PC += ins.len;
+    this->owed_cycles = ins.cycles;
+#ifdef ENABLE_JIT
+    this->fallthrough = this->PC;
+#endif
+    return ins.op;
+}
+
+Decoded CPU::decode(u16 addr) {
+    Decoded ins;
+    ins.op = this->ram->get(addr);
+    ins.arg.as_u16 = 0xCA75;
+    u8 arg_len = OP_ARG_BYTES[OP_ARG_TYPES[ins.op]];
+    if(arg_len == 1) {
+        ins.arg.as_u8 = this->ram->get(addr + 1);
     }
-    if(owed_cycles > 0) owed_cycles -= 1; // HALT has cycles=0
+    if(arg_len == 2) {
+        u16 low = this->ram->get(addr + 1);
+        u16 high = this->ram->get(addr + 2);
+        ins.arg.as_u16 = high << 8 | low;
+    }
+    ins.len = 1 + arg_len;
+    // HALT has cycles=0
+    ins.cycles = OP_CYCLES[ins.op] > 0 ? OP_CYCLES[ins.op] - 1 : 0;
+    if(ins.op == 0xCB) {
+        // treat CB ops as taking their real opcode as an argument
+        ins.arg.as_u8 = this->ram->get(addr + 1);
+        ins.len = 2;
+        ins.cycles = OP_CB_CYCLES[ins.arg.as_u8] - 1;
+    }
+    return ins;
 }
 
 /**
- * Execute a normal instruction (everything except for those
- * prefixed with 0xCB)
+ * Decode the instruction at PC, which is `offset` bytes into the cart,
+ * and keep it for next time - unless it runs off the end of the bank,
+ * in which case its argument depends on which bank comes next.
  */
-void CPU::tick_main(u8 op, oparg arg) {
-    // Load args
-
-    // Execute
-    u8 val = 0, carry = 0;
-    u16 val16 = 0;
-    switch(op) {
-        // clang-format off
-        case 0x00: /* NOP */; break;
-        case 0x01: this->BC = arg.as_u16; break;
-        case 0x02: this->ram->set(this->BC, this->A); break;
-        case 0x03: this->BC++; break;
-        case 0x08:
-            this->ram->set(arg.as_u16+1, ((this->SP >> 8) & 0xFF));
-            this->ram->set(arg.as_u16, (this->SP & 0xFF));
-            break;  // how does this fit?
-        case 0x0A: this->A = this->ram->get(this->BC); break;
-        case 0x0B: this->BC--; break;
-
-        case 0x10: this->stop = true; break;
-        case 0x11: this->DE = arg.as_u16; break;
-        case 0x12: this->ram->set(this->DE, this->A); break;
-        case 0x13: this->DE++; break;
-        case 0x18: this->PC += arg.as_i8; break;
-        case 0x1A: this->A = this->ram->get(this->DE); break;
-        case 0x1B: this->DE--; break;
-
-        case 0x20: if(!this->FLAG_Z) this->PC += arg.as_i8; break;
-        case 0x21: this->HL = arg.as_u16; break;
-        case 0x22: this->ram->set(this->HL++, this->A); break;
-        case 0x23: this->HL++; break;
-        case 0x27:
-            val16 = this->A;
-            if(this->FLAG_N == 0) {
-                if (this->FLAG_H || (val16 & 0x0F) > 9) val16 += 6;
-                if (this->FLAG_C || val16 > 0x9F) val16 += 0x60;
-            }
-            else {
-                if(this->FLAG_H) {
-                    val16 -= 6;
-                    if (this->FLAG_C == 0) val16 &= 0xFF;
-                }
-                if(this->FLAG_C) val16 -= 0x60;
-            }
-            this->FLAG_H = false;
-            if(val16 & 0x100) this->FLAG_C = true;
-            this->A = val16 & 0xFF;
-            this->FLAG_Z = this->A == 0;
-            break;
-        case 0x28: if(this->FLAG_Z) this->PC += arg.as_i8; break;
-        case 0x2A: this->A = this->ram->get(this->HL++); break;
-        case 0x2B: this->HL--; break;
-        case 0x2F: this->A ^= 0xFF; this->FLAG_N = true; this->FLAG_H = true; break;
-
-        case 0x30: if(!this->FLAG_C) this->PC += arg.as_i8; break;
-        case 0x31: this->SP = arg.as_u16; break;
-        case 0x32: this->ram->set(this->HL--, this->A); break;
-        case 0x33: this->SP++; break;
-        case 0x37: this->FLAG_N = false; this->FLAG_H = false; this->FLAG_C = true; break;
-        case 0x38: if(this->FLAG_C) this->PC += arg.as_i8; break;
-        case 0x3A: this->A = this->ram->get(this->HL--); break;
-        case 0x3B: this->SP--; break;
-        case 0x3F: this->FLAG_C = !this->FLAG_C; this->FLAG_N = false; this->FLAG_H = false; break;
-
-        case 0x04: case 0x0C: // INC r
-        case 0x14: case 0x1C:
-        case 0x24: case 0x2C:
-        case 0x34: case 0x3C:
-            val = this->get_reg((op-0x04)/8);
-            this->FLAG_H = (val & 0x0F) == 0x0F;
-            val++;
-            this->FLAG_Z = val == 0;
-            this->FLAG_N = false;
-            this->set_reg((op-0x04)/8, val);
-            break;
-
-        case 0x05: case 0x0D: // DEC r
-        case 0x15: case 0x1D:
-        case 0x25: case 0x2D:
-        case 0x35: case 0x3D:
-            val = this->get_reg((op-0x05)/8);
-            val--;
-            this->FLAG_H = (val & 0x0F) == 0x0F;
-            this->FLAG_Z = val == 0;
-            this->FLAG_N = true;
-            this->set_reg((op-0x05)/8, val);
-            break;
-
-        case 0x06: case 0x0E: // LD r,n
-        case 0x16: case 0x1E:
-        case 0x26: case 0x2E:
-        case 0x36: case 0x3E:
-            this->set_reg((op-0x06)/8, arg.as_u8);
-            break;
-
-        case 0x07: // RCLA
-        case 0x17: // RLA
-        case 0x0F: // RRCA
-        case 0x1F: // RRA
-            carry = this->FLAG_C ? 1 : 0;
-            if(op == 0x07) { // RCLA
-                this->FLAG_C = (this->A & (1 << 7)) != 0;
-                this->A = (this->A << 1) | (this->A >> 7);
-            }
-            if(op == 0x17) { // RLA
-                this->FLAG_C = (this->A & (1 << 7)) != 0;
-                this->A = (this->A << 1) | carry;
-            }
-            if(op == 0x0F) { // RRCA
-                this->FLAG_C = (this->A & (1 << 0)) != 0;
-                this->A = (this->A >> 1) | (this->A << 7);
-            }
-            if(op == 0x1F) { // RRA
-                this->FLAG_C = (this->A & (1 << 0)) != 0;
-                this->A = (this->A >> 1) | (carry << 7);
-            }
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = false;
-            break;
-
-        case 0x09: // ADD HL,rr
-        case 0x19:
-        case 0x29:
-        case 0x39:
-            if(op == 0x09) val16 = this->BC;
-            if(op == 0x19) val16 = this->DE;
-            if(op == 0x29) val16 = this->HL;
-            if(op == 0x39) val16 = this->SP;
-            this->FLAG_H = ((this->HL & 0x0FFF) + (val16 & 0x0FFF) > 0x0FFF);
-            this->FLAG_C = (this->HL + val16 > 0xFFFF);
-            this->HL += val16;
-            this->FLAG_N = false;
-            break;
-
-        case 0x40 ... 0x7F: // LD r,r
-            if(op == 0x76) {
-                // FIXME: weird timing side effects
-                this->halt = true;
-                break;
-            }
-            this->set_reg((op - 0x40)>>3, this->get_reg(op - 0x40));
-            break;
-
-        case 0x80 ... 0x87: this->_add(this->get_reg(op)); break;
-        case 0x88 ... 0x8F: this->_adc(this->get_reg(op)); break;
-        case 0x90 ... 0x97: this->_sub(this->get_reg(op)); break;
-        case 0x98 ... 0x9F: this->_sbc(this->get_reg(op)); break;
-        case 0xA0 ... 0xA7: this->_and(this->get_reg(op)); break;
-        case 0xA8 ... 0xAF: this->_xor(this->get_reg(op)); break;
-        case 0xB0 ... 0xB7: this->_or(this->get_reg(op)); break;
-        case 0xB8 ... 0xBF: this->_cp(this->get_reg(op)); break;
-        
-        case 0xC0: if(!this->FLAG_Z) this->PC = this->pop(); break;
-        case 0xC1: this->BC = this->pop(); break;
-        case 0xC2: if(!this->FLAG_Z) this->PC = arg.as_u16; break;
-        case 0xC3: this->PC = arg.as_u16; break;
-        case 0xC4: if(!this->FLAG_Z) {this->push(this->PC); this->PC = arg.as_u16;} break;
-        case 0xC5: this->push(this->BC); break;
-        case 0xC6: this->_add(arg.as_u8); break;
-        case 0xC7: this->push(this->PC); this->PC = 0x00; break;
-        case 0xC8: if(this->FLAG_Z) this->PC = this->pop(); break;
-        case 0xC9: this->PC = this->pop(); break;
-        case 0xCA: if(this->FLAG_Z) this->PC = arg.as_u16; break;
-        // case 0xCB: break;
-        case 0xCC: if(this->FLAG_Z) {this->push(this->PC); this->PC = arg.as_u16;} break;
-        case 0xCD: this->push(this->PC); this->PC = arg.as_u16; break;
-        case 0xCE: this->_adc(arg.as_u8); break;
-        case 0xCF: this->push(this->PC); this->PC = 0x08; break;
-
-        case 0xD0: if(!this->FLAG_C) this->PC = this->pop(); break;
-        case 0xD1: this->DE = this->pop(); break;
-        case 0xD2: if(!this->FLAG_C) this->PC = arg.as_u16; break;
-        // case 0xD3: break;
-        case 0xD4: if(!this->FLAG_C) {this->push(this->PC); this->PC = arg.as_u16;} break;
-        case 0xD5: this->push(this->DE); break;
-        case 0xD6: this->_sub(arg.as_u8); break;
-        case 0xD7: this->push(this->PC); this->PC = 0x10; break;
-        case 0xD8: if(this->FLAG_C) this->PC = this->pop(); break;
-        case 0xD9: this->PC = this->pop(); this->interrupts = true; break;
-        case 0xDA: if(this->FLAG_C) this->PC = arg.as_u16; break;
-        // case 0xDB: break;
-        case 0xDC: if(this->FLAG_C) {this->push(this->PC); this->PC = arg.as_u16;} break;
-        // case 0xDD: break;
-        case 0xDE: this->_sbc(arg.as_u8); break;
-        case 0xDF: this->push(this->PC); this->PC = 0x18; break;
-
-        case 0xE0: this->ram->set(0xFF00 + arg.as_u8, this->A); if(arg.as_u8 == 0x01) {putchar(this->A);}; break;
-        case 0xE1: this->HL = this->pop(); break;
-        case 0xE2: this->ram->set(0xFF00 + this->C, this->A); if(this->C == 0x01) {putchar(this->A);}; break;
-        // case 0xE3: break;
-        // case 0xE4: break;
-        case 0xE5: this->push(this->HL); break;
-        case 0xE6: this->_and(arg.as_u8); break;
-        case 0xE7: this->push(this->PC); this->PC = 0x20; break;
-        case 0xE8:
-            val16 = this->SP + arg.as_i8;
-            //this->FLAG_H = ((this->SP & 0x0FFF) + (arg.as_i8 & 0x0FFF) > 0x0FFF);
-            //this->FLAG_C = (this->SP + arg.as_i8 > 0xFFFF);
-            this->FLAG_H = ((this->SP ^ arg.as_i8 ^ val16) & 0x10 ? true : false);
-            this->FLAG_C = ((this->SP ^ arg.as_i8 ^ val16) & 0x100 ? true : false);
-            this->SP += arg.as_i8;
-            this->FLAG_Z = false;
-            this->FLAG_N = false;
-            break;
-        case 0xE9: this->PC = this->HL; break;
-        case 0xEA: this->ram->set(arg.as_u16, this->A); break;
-        // case 0xEB: break;
-        // case 0xEC: break;
-        // case 0xED: break;
-        case 0xEE: this->_xor(arg.as_u8); break;
-        case 0xEF: this->push(this->PC); this->PC = 0x28; break;
-
-        case 0xF0: this->A = this->ram->get(0xFF00 + arg.as_u8); break;
-        case 0xF1: this->AF = (this->pop() & 0xFFF0); break;
-        case 0xF2: this->A = this->ram->get(0xFF00 + this->C); break;
-        case 0xF3: this->interrupts = false; break;
-        // case 0xF4: break;
-        case 0xF5: this->push(this->AF); break;
-        case 0xF6: this->_or(arg.as_u8); break;
-        case 0xF7: this->push(this->PC); this->PC = 0x30; break;
-        case 0xF8:
-            if(arg.as_i8 >= 0) {
-                this->FLAG_C = ((this->SP & 0xFF) + (arg.as_i8 & 0xFF)) > 0xFF;
-                this->FLAG_H = ((this->SP & 0x0F) + (arg.as_i8 & 0x0F)) > 0x0F;
-            } else {
-                this->FLAG_C = ((this->SP + arg.as_i8) & 0xFF) <= (this->SP & 0xFF);
-                this->FLAG_H = ((this->SP + arg.as_i8) & 0x0F) <= (this->SP & 0x0F);
-            }
-            // this->FLAG_H = ((((this->SP & 0x0f) + (arg.as_u8 & 0x0f)) & 0x10) != 0);
-            // this->FLAG_C = ((((this->SP & 0xff) + (arg.as_u8 & 0xff)) & 0x100) != 0);
-            this->HL = this->SP + arg.as_i8;
-            this->FLAG_Z = false;
-            this->FLAG_N = false;
-            break;
-        case 0xF9: this->SP = this->HL; break;
-        case 0xFA: this->A = this->ram->get(arg.as_u16); break;
-        case 0xFB: this->interrupts = true; break;
-        case 0xFC: throw new UnitTestPassed(); // unofficial
-        case 0xFD: throw new UnitTestFailed(); // unofficial
-        case 0xFE: this->_cp(arg.as_u8); break;
-        case 0xFF: this->push(this->PC); this->PC = 0x38; break;
-
-        // missing ops
-        default: throw new InvalidOpcode(op);
-            // clang-format on
-    }
+Decoded CPU::decode_rom(int offset) {
+    auto &bank = this->decoded[offset / ROM_BANK_SIZE];
+    if(!bank) bank = std::make_unique<Decoded[]>(ROM_BANK_SIZE);
+    Decoded ins = this->decode(this->PC);
+    if(offset % ROM_BANK_SIZE + ins.len <= ROM_BANK_SIZE) bank[offset % ROM_BANK_SIZE] = ins;
+    return ins;
 }
 
 /**
@@ -461,97 +660,70 @@ void CPU::tick_main(u8 op, oparg arg) {
  * data based on the 3 again.
  */
 void CPU::tick_cb(u8 op) {
-    u8 val, bit;
-    bool orig_c;
+    u8 val, bit, carry;
 
     val = this->get_reg(op);
     switch(op & 0xF8) {
         // RLC
         case 0x00 ... 0x07:
-            this->FLAG_C = (val & (1 << 7)) != 0;
-            val <<= 1;
-            if(this->FLAG_C) val |= (1 << 0);
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            carry = (val >> 7) & 1;
+            val = (val << 1) | carry;
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // RRC
         case 0x08 ... 0x0F:
-            this->FLAG_C = (val & (1 << 0)) != 0;
-            val >>= 1;
-            if(this->FLAG_C) val |= (1 << 7);
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            carry = val & 1;
+            val = (val >> 1) | (carry << 7);
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // RL
         case 0x10 ... 0x17:
-            orig_c = this->FLAG_C;
-            this->FLAG_C = (val & (1 << 7)) != 0;
-            val <<= 1;
-            if(orig_c) val |= (1 << 0);
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            carry = (val >> 7) & 1;
+            val = (val << 1) | this->flag_c();
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // RR
         case 0x18 ... 0x1F:
-            orig_c = this->FLAG_C;
-            this->FLAG_C = (val & (1 << 0)) != 0;
-            val >>= 1;
-            if(orig_c) val |= (1 << 7);
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            carry = val & 1;
+            val = (val >> 1) | (this->flag_c() << 7);
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // SLA
         case 0x20 ... 0x27:
-            this->FLAG_C = (val & (1 << 7)) != 0;
+            carry = (val >> 7) & 1;
             val <<= 1;
-            val &= 0xFF;
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // SRA
         case 0x28 ... 0x2F:
-            this->FLAG_C = (val & (1 << 0)) != 0;
+            carry = val & 1;
             val >>= 1;
             if(val & (1 << 6)) val |= (1 << 7);
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // SWAP
         case 0x30 ... 0x37:
             val = ((val & 0xF0) >> 4) | ((val & 0x0F) << 4);
-            this->FLAG_C = false;
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            this->lazy = {LazyFlags::LOGIC, 0, 0, 0, val};
             break;
 
         // SRL
         case 0x38 ... 0x3F:
-            this->FLAG_C = (val & (1 << 0)) != 0;
+            carry = val & 1;
             val >>= 1;
-            this->FLAG_N = false;
-            this->FLAG_H = false;
-            this->FLAG_Z = val == 0;
+            this->lazy = {LazyFlags::LOGIC, 0, 0, carry, val};
             break;
 
         // BIT
         case 0x40 ... 0x7F:
             bit = (op & 0b00111000) >> 3;
-            this->FLAG_Z = (val & (1 << bit)) == 0;
-            this->FLAG_N = false;
-            this->FLAG_H = true;
+            this->lazy = {LazyFlags::LOGIC, 0, 1, this->flag_c(), (u16)(val & (1 << bit))};
             break;
 
         // RES
@@ -572,73 +744,97 @@ void CPU::tick_cb(u8 op) {
     this->set_reg(op, val);
 }
 
+/**
+ * Work out F from whichever operation last set the flags - the
+ * common cases (Z and C for conditional jumps) have shortcuts in
+ * flag_z() and flag_c(), this is for anything which needs them all.
+ */
+u8 CPU::flags() {
+    auto &l = this->lazy;
+    if(l.op == LazyFlags::NONE) return this->F;
+
+    this->FLAG_Z = (l.res & 0xFF) == 0;
+    this->FLAG_C = l.carry;
+    switch(l.op) {
+        case LazyFlags::ADD:
+            this->FLAG_N = false;
+            this->FLAG_H = ((l.a ^ l.b ^ l.res) & 0x10) != 0;
+            break;
+        case LazyFlags::SUB:
+            this->FLAG_N = true;
+            this->FLAG_H = ((l.a ^ l.b ^ l.res) & 0x10) != 0;
+            break;
+        case LazyFlags::INC:
+            this->FLAG_N = false;
+            this->FLAG_H = (l.res & 0x0F) == 0x00;
+            break;
+        case LazyFlags::DEC:
+            this->FLAG_N = true;
+            this->FLAG_H = (l.res & 0x0F) == 0x0F;
+            break;
+        case LazyFlags::LOGIC:
+            this->FLAG_N = false;
+            this->FLAG_H = l.b;
+            break;
+    }
+    l.op = LazyFlags::NONE;
+    return this->F;
+}
+
 void CPU::_xor(u8 val) {
     this->A ^= val;
-
-    this->FLAG_Z = this->A == 0;
-    this->FLAG_N = false;
-    this->FLAG_H = false;
-    this->FLAG_C = false;
+    this->lazy = {LazyFlags::LOGIC, 0, 0, 0, this->A};
 }
 
 void CPU::_or(u8 val) {
     this->A |= val;
-
-    this->FLAG_Z = this->A == 0;
-    this->FLAG_N = false;
-    this->FLAG_H = false;
-    this->FLAG_C = false;
+    this->lazy = {LazyFlags::LOGIC, 0, 0, 0, this->A};
 }
 
 void CPU::_and(u8 val) {
     this->A &= val;
-
-    this->FLAG_Z = this->A == 0;
-    this->FLAG_N = false;
-    this->FLAG_H = true;
-    this->FLAG_C = false;
+    this->lazy = {LazyFlags::LOGIC, 0, 1, 0, this->A};
 }
 
 void CPU::_cp(u8 val) {
-    this->FLAG_Z = this->A == val;
-    this->FLAG_N = true;
-    this->FLAG_H = (this->A & 0x0F) < (val & 0x0F);
-    this->FLAG_C = this->A < val;
+    u16 res = this->A - val;
+    this->lazy = {LazyFlags::SUB, this->A, val, (u8)((res >> 8) & 1), res};
 }
 
 void CPU::_add(u8 val) {
-    this->FLAG_C = this->A + val > 0xFF;
-    this->FLAG_H = (this->A & 0x0F) + (val & 0x0F) > 0x0F;
-    this->FLAG_N = false;
-    this->A += val;
-    this->FLAG_Z = this->A == 0;
+    u16 res = this->A + val;
+    this->lazy = {LazyFlags::ADD, this->A, val, (u8)(res >> 8), res};
+    this->A = res;
 }
 
 void CPU::_adc(u8 val) {
-    int carry = this->FLAG_C ? 1 : 0;
-    this->FLAG_C = this->A + val + carry > 0xFF;
-    this->FLAG_H = (this->A & 0x0F) + (val & 0x0F) + carry > 0x0F;
-    this->FLAG_N = false;
-    this->A += val + carry;
-    this->FLAG_Z = this->A == 0;
+    u16 res = this->A + val + this->flag_c();
+    this->lazy = {LazyFlags::ADD, this->A, val, (u8)(res >> 8), res};
+    this->A = res;
 }
 
 void CPU::_sub(u8 val) {
-    this->FLAG_C = this->A < val;
-    this->FLAG_H = (this->A & 0x0F) < (val & 0x0F);
-    this->A -= val;
-    this->FLAG_Z = this->A == 0;
-    this->FLAG_N = true;
+    u16 res = this->A - val;
+    this->lazy = {LazyFlags::SUB, this->A, val, (u8)((res >> 8) & 1), res};
+    this->A = res;
 }
 
 void CPU::_sbc(u8 val) {
-    int carry = this->FLAG_C ? 1 : 0;
-    auto res = this->A - val - carry;
-    this->FLAG_H = ((this->A ^ val ^ (res & 0xff)) & (1 << 4)) != 0;
-    this->FLAG_C = res < 0;
-    this->A -= val + carry;
-    this->FLAG_Z = this->A == 0;
-    this->FLAG_N = true;
+    u16 res = this->A - val - this->flag_c();
+    this->lazy = {LazyFlags::SUB, this->A, val, (u8)((res >> 8) & 1), res};
+    this->A = res;
+}
+
+u8 CPU::_inc(u8 val) {
+    u8 res = val + 1;
+    this->lazy = {LazyFlags::INC, val, 0, this->flag_c(), res};
+    return res;
+}
+
+u8 CPU::_dec(u8 val) {
+    u8 res = val - 1;
+    this->lazy = {LazyFlags::DEC, val, 0, this->flag_c(), res};
+    return res;
 }
 
 void CPU::push(u16 val) {
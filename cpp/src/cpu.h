@@ -2,9 +2,14 @@
 #define ROSETTABOY_CPU_H
 
 #include <cstdint>
+#include <memory>
 
 #include "cart.h"
 #include "ram.h"
+#include "timer.h"
+#ifdef ENABLE_JIT
+#include "jit.h"
+#endif
 
 const u8 OP_CYCLES[] = {
     // 1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
@@ -153,18 +158,68 @@ union oparg {
     u16 as_u16; // H
 };
 
+/**
+ * An instruction which has been read from RAM and had its
+ * argument, length and cycle count worked out
+ */
+struct Decoded {
+    oparg arg;
+    u8 op;
+    u8 len; // 0 = not decoded yet
+    u8 cycles;
+};
+
+/**
+ * Which kind of operation last set the flags - see CPU::flags()
+ */
+namespace LazyFlags {
+    enum LazyFlags {
+        NONE,  // F is up to date (and res / carry match its Z / C)
+        ADD,   // ADD, ADC: res = a + b + carry in
+        SUB,   // SUB, SBC, CP: res = a - b - carry in
+        INC,   // res = a + 1, C is left alone
+        DEC,   // res = a - 1, C is left alone
+        LOGIC, // AND, OR, XOR, BIT, CB shifts: H = b
+    };
+}
+
 class CPU {
+    friend class JIT;
+
 public:
     RAM *ram;
     bool stop = false;
     bool stepping = false;
+    // Echo bytes written to the serial port to stdout
+    bool print_serial = true;
+#ifdef ENABLE_STATS
+    CPUCounts counts;
+#endif
 
 private:
     bool interrupts = true;
     bool halt = false;
     bool debug = true;
-    int cycle = 0;
     int owed_cycles = 0;
+    std::unique_ptr<Timer> timer;
+    // Decoded instructions for each ROM bank that code has run from
+    std::unique_ptr<Decoded[]> decoded[0x100];
+    // Most flags are overwritten before anything looks at them, so
+    // rather than working them all out after every ALU operation, we
+    // remember the operation and work them out when they're needed
+    struct {
+        u8 op = LazyFlags::NONE;
+        u8 a = 0;
+        u8 b = 0;
+        u8 carry = 0;
+        u16 res = 0;
+    } lazy;
+#ifdef ENABLE_JIT
+    std::unique_ptr<JIT> jit;
+    // Where PC would be if the last instruction didn't jump - blocks only
+    // start where something jumped to, so we only look for one there
+    u16 fallthrough = 0;
+#endif
 
 public:
     union {
@@ -208,19 +263,31 @@ public:
 
 public:
     CPU(RAM *ram, bool debug);
-    void tick();
+    int tick(int cycles);
     void interrupt(Interrupt::Interrupt i);
     void dump_regs();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
 
 private:
+    template <bool debug_cpu> int tick_cycles(int cycles);
+    template <bool debug_cpu> int tick_owed(int cycles);
     void tick_dma();
-    void tick_clock();
     bool check_interrupt(u8 queue, u8 i, u16 handler);
-    void tick_interrupts();
-    void tick_instructions();
-    void tick_main(u8 op, oparg arg);
+    template <bool debug_cpu> void tick_interrupts();
+    template <bool debug_cpu> bool catch_up(int &ran, int cycles);
+    // inlined into the end of every instruction handler, see tick_cycles
+    template <bool debug_cpu> __attribute__((always_inline)) u8 fetch(oparg &arg);
+    Decoded decode(u16 addr);
+    Decoded decode_rom(int offset);
     void tick_cb(u8 op);
 
+    u8 flags();
+    inline bool flag_z() { return (this->lazy.res & 0xFF) == 0; }
+    inline bool flag_c() { return this->lazy.carry; }
+    // F has been set directly - keep flag_z() and flag_c() in step with it
+    inline void flags_written() { this->lazy = {LazyFlags::NONE, 0, 0, (u8)this->FLAG_C, (u16)!this->FLAG_Z}; }
+
     void _xor(u8 val);
     void _or(u8 val);
     void _and(u8 val);
@@ -229,6 +296,8 @@ private:
     void _adc(u8 val);
     void _sub(u8 val);
     void _sbc(u8 val);
+    u8 _inc(u8 val);
+    u8 _dec(u8 val);
 
     void push(u16 val);
     u16 pop();
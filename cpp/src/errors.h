@@ -79,5 +79,28 @@ class HeaderChecksumFailed : public UserException {
 public:
     HeaderChecksumFailed(int header_checksum) { this->set_msg("Invalid header checksum: %d", header_checksum); }
 };
+class InvalidSaveState : public UserException {
+public:
+    InvalidSaveState(const char *reason) { this->set_msg("Invalid save state: %s", reason); }
+};
+class SaveStateFileError : public UserException {
+public:
+    SaveStateFileError(std::string filename, int err) {
+        this->set_msg("Error opening %s: %s", filename.c_str(), strerror(err));
+    }
+};
+class AudioFileError : public UserException {
+public:
+    AudioFileError(std::string filename, int err) {
+        this->set_msg("Error writing %s: %s", filename.c_str(), strerror(err));
+    }
+};
+
+// System error, ie the OS wouldn't give us something we asked for
+class SystemException : public EmuException {};
+class BranchFailed : public SystemException {
+public:
+    BranchFailed(const char *call, int err) { this->set_msg("Error branching, %s failed: %s", call, strerror(err)); }
+};
 
 #endif // ROSETTABOY_ERRORS_H
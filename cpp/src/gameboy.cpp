@@ -1,29 +1,257 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
 #include "gameboy.h"
+#include "wav.h"
+
+// Keyframes cost ~10x as much space as the deltas in between, but the
+// deltas grow the further they get from their keyframe
+const int REWIND_KEYFRAME_EVERY = 60;
 
-GameBoy::GameBoy(Args *args) {
-    this->cart = new Cart(args->rom);
-    this->ram = new RAM(this->cart, args->debug_ram);
-    this->cpu = new CPU(this->ram, args->debug_cpu);
-    this->gpu = new GPU(this->cpu, cart->name, args->headless, args->debug_gpu);
-    this->buttons = new Buttons(this->cpu, args->headless);
-    if(!args->silent) new APU(this->cpu, args->debug_apu);
-    this->clock = new Clock(this->buttons, args->frames, args->profile, args->turbo);
+GameBoy::GameBoy(const GameBoyOptions &options) {
+    this->cart = std::make_unique<Cart>(options.rom, options.save);
+    this->ram = std::make_unique<RAM>(this->cart.get(), options.boot, options.debug_ram);
+    this->cpu = std::make_unique<CPU>(this->ram.get(), options.debug_cpu);
+    this->cpu->print_serial = options.print_serial;
+    this->gpu = std::make_unique<GPU>(this->cpu.get(), cart->name, options.headless, options.debug_gpu);
+    this->buttons = std::make_unique<Buttons>(this->cpu.get(), options.headless);
+    if(!options.silent || !options.audio_out.empty()) {
+        bool device = options.audio_device && options.audio_out.empty();
+        this->apu = std::make_unique<APU>(this->cpu.get(), options.audio_rate, options.debug_apu, device);
+        if(!options.audio_out.empty()) {
+            this->apu->file = std::make_unique<WavFile>(options.audio_out, options.audio_rate);
+        }
+    }
+    this->clock = std::make_unique<Clock>(this->buttons.get(), options.frames, options.profile, options.turbo);
+    this->set_render_every(options.render_every);
+    if(options.rewind > 0) {
+        size_t bytes = (size_t)options.rewind_memory << 20;
+        this->rewind = std::make_unique<Rewind>(bytes, options.rewind * 60, REWIND_KEYFRAME_EVERY);
+    }
+    STAT(this->stats.path = options.stats);
 }
 
 /**
  * GB CPU runs at 4MHz, but each action takes a multiple of 4 hardware
  * cycles. So to avoid overhead, we run the main loop at 1MHz, and each
  * "cycle" that each subsystem counts represents 4 hardware cycles.
+ *
+ * Runs until one of the subsystems throws a ControlledExit (or an error).
  */
 void GameBoy::run() {
     while(true) {
-        this->tick();
+        if(!this->buttons->rewinding || !this->step_back()) this->run_frame();
+    }
+}
+
+/**
+ * Run until the start of the next frame, at which point framebuffer()
+ * holds the frame which was just drawn (if it was drawn at all - see
+ * set_render_every)
+ */
+void GameBoy::run_frame() {
+    if(this->rewind) this->rewind->capture(this);
+    this->run_cycles(17556 - this->cycle % 17556);
+}
+
+/**
+ * Go back to the frame before the one which was just run, and run it
+ * again to redraw it - returns false if rewind is off, or we've already
+ * gone back as far as it goes. Buttons held right now stay held, rather
+ * than going back to what was held at the time.
+ */
+bool GameBoy::step_back() {
+    // The newest frame in the history is the one which was just run
+    if(!this->rewind || this->rewind->frames() < 2) return false;
+    u8 held = this->buttons->get_buttons();
+    this->rewind->drop();
+    this->rewind->restore(this);
+    this->buttons->set_buttons(held);
+    this->run_frame();
+    return true;
+}
+
+void GameBoy::run_cycles(int cycles) {
+    uint64_t end = this->cycle + cycles;
+    while(this->cycle < end) {
+        this->tick(end - this->cycle);
     }
 }
 
-void GameBoy::tick() {
-    this->cpu->tick();
-    this->gpu->tick();
-    this->buttons->tick();
-    this->clock->tick();
-}
\ No newline at end of file
+/**
+ * Most cycles, only the CPU has anything to do - so we let the CPU run
+ * by itself until the next cycle where another subsystem has an event
+ * scheduled (or until the CPU writes to a register that another subsystem
+ * is watching), and then let everybody else catch up in one go.
+ */
+void GameBoy::tick(int max_cycles) {
+    int cycles = std::min({max_cycles, this->gpu->cycles_until_event(), this->buttons->cycles_until_event(),
+                           this->clock->cycles_until_event()});
+
+    STAT(this->stats.start());
+    int ran = this->cpu->tick(cycles);
+    STAT(this->stats.lap(Part::CPU));
+    this->gpu->tick(ran);
+    STAT(this->stats.lap(Part::GPU));
+    this->buttons->tick(ran);
+    STAT(this->stats.lap(Part::INPUT));
+    if(this->apu) this->apu->tick(ran);
+    STAT(this->stats.lap(Part::APU));
+    this->clock->tick(ran);
+    STAT(this->stats.lap(Part::PACING));
+    this->ram->sync_needed = false;
+    this->cycle += ran;
+#ifdef ENABLE_STATS
+    if((int)(this->cycle % 17556) < ran) this->stats.end_frame(this->cpu->counts, this->ram->counts);
+#endif
+}
+
+/**
+ * Press every button in `mask` (made of Button bits) and release the rest
+ */
+void GameBoy::set_buttons(u8 mask) { this->buttons->set_buttons(mask); }
+
+/**
+ * Draw every Nth frame (or none if 0) - eg a test runner can leave
+ * rendering off, and then set this back to 1 to take a screenshot
+ */
+void GameBoy::set_render_every(int n) { this->gpu->render_every = n; }
+
+SDL_Surface *GameBoy::framebuffer() { return this->gpu->buffer; }
+
+/**
+ * Take up to `count` of the stereo samples generated so far (at the
+ * options' audio_rate), and return how many were taken - which is none
+ * if sound is off, or if an SDL audio device or file is already taking
+ * them.
+ * Only the latest 8192 are kept (~170ms at 48kHz), so call this at least
+ * every few frames.
+ */
+int GameBoy::audio_samples(StereoSample *samples, int count) {
+    if(!this->apu || this->apu->device || this->apu->file) return 0;
+    this->apu->sync();
+    return this->apu->samples.pop(samples, count);
+}
+
+/**
+ * Snapshot the whole machine into `out` - which is cleared first rather
+ * than reallocated, so saving into the same buffer again is cheap
+ */
+void GameBoy::save_state(std::vector<u8> &out) {
+    out.clear();
+    StateWriter w(&out);
+    w.put(STATE_MAGIC);
+    w.put(STATE_VERSION);
+    size_t len_at = w.size();
+    w.put((u32)0);
+    w.put(this->cart->checksum);
+    w.put(this->cart->rom_size);
+
+    w.put(this->cycle);
+    this->cpu->save_state(&w);
+    this->ram->save_state(&w);
+    this->gpu->save_state(&w);
+    this->buttons->save_state(&w);
+    this->clock->save_state(&w);
+
+    // Sound is optional, so its state is prefixed with its length,
+    // and skipped when loaded into a GameBoy without it
+    size_t apu_at = w.size();
+    w.put((u32)0);
+    if(this->apu) {
+        this->apu->save_state(&w);
+        w.patch(apu_at, w.size() - apu_at - sizeof(u32));
+    }
+
+    w.patch(len_at, w.size());
+}
+
+void GameBoy::save_state(const std::string &path) {
+    std::vector<u8> state;
+    this->save_state(state);
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp) throw new SaveStateFileError(path, errno);
+    fwrite(state.data(), 1, state.size(), fp);
+    fclose(fp);
+}
+
+/**
+ * Restore a state from save_state(). Everything is checked before
+ * anything is overwritten, so a bad state leaves the machine as it was.
+ */
+void GameBoy::load_state(const u8 *data, size_t len) {
+    StateReader check(data, len, true);
+    this->load_state(&check);
+    StateReader r(data, len);
+    this->load_state(&r);
+}
+
+void GameBoy::load_state(StateReader *in) {
+    u32 magic, version, state_len, rom_size;
+    u16 checksum;
+    in->read(magic);
+    in->read(version);
+    in->read(state_len);
+    if(magic != STATE_MAGIC) throw new InvalidSaveState("not a save state");
+    if(version != STATE_VERSION) throw new InvalidSaveState("made by a different version of the emulator");
+    if(state_len != in->remaining() + 3 * sizeof(u32)) throw new InvalidSaveState("wrong length");
+    in->read(checksum);
+    in->read(rom_size);
+    if(checksum != this->cart->checksum || rom_size != this->cart->rom_size) {
+        throw new InvalidSaveState("made with a different ROM");
+    }
+
+    in->get(this->cycle);
+    this->cpu->load_state(in);
+    this->ram->load_state(in);
+    this->gpu->load_state(in);
+    this->buttons->load_state(in);
+    this->clock->load_state(in);
+
+    u32 apu_len;
+    in->read(apu_len);
+    if(this->apu && apu_len) {
+        size_t before = in->remaining();
+        this->apu->load_state(in);
+        if(before - in->remaining() != apu_len) throw new InvalidSaveState("sound state is the wrong length");
+    } else {
+        in->skip(apu_len);
+    }
+}
+
+void GameBoy::load_state(const std::vector<u8> &state) { this->load_state(state.data(), state.size()); }
+
+void GameBoy::load_state(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(!fp) throw new SaveStateFileError(path, errno);
+    std::vector<u8> state;
+    u8 buf[64 * 1024];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        state.insert(state.end(), buf, buf + n);
+    }
+    fclose(fp);
+    this->load_state(state);
+}
+
+/**
+ * Let go of the window, input events, audio device, .sav file and
+ * --stats file without closing them, and run flat out from now on - for
+ * a copy of this GameBoy in a forked process (see branch.h), where those
+ * belong to the parent
+ */
+void GameBoy::detach() {
+    STAT(this->stats.path.clear());
+    this->cart->detach();
+    this->gpu->detach();
+    this->buttons->detach();
+    this->clock->detach();
+    if(this->apu) this->apu->detach();
+}
+
+/**
+ * Timings and counters for each frame run so far - always empty unless
+ * built with ENABLE_STATS (see stats.h)
+ */
+const std::vector<FrameStats> &GameBoy::frame_stats() { return this->stats.frames; }
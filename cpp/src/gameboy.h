@@ -1,27 +1,54 @@
 #ifndef ROSETTABOY_GAMEBOY_H
 #define ROSETTABOY_GAMEBOY_H
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "apu.h"
-#include "args.h"
 #include "buttons.h"
 #include "cart.h"
 #include "clock.h"
 #include "cpu.h"
 #include "gpu.h"
+#include "options.h"
+#include "rewind.h"
+#include "stats.h"
 
 class GameBoy {
 private:
-    Cart *cart = nullptr;
-    RAM *ram = nullptr;
-    CPU *cpu = nullptr;
-    GPU *gpu = nullptr;
-    Buttons *buttons = nullptr;
-    Clock *clock = nullptr;
+    std::unique_ptr<Cart> cart;
+    std::unique_ptr<RAM> ram;
+    std::unique_ptr<CPU> cpu;
+    std::unique_ptr<GPU> gpu;
+    std::unique_ptr<Buttons> buttons;
+    std::unique_ptr<Clock> clock;
+    std::unique_ptr<APU> apu;
+    std::unique_ptr<Rewind> rewind;
+    Stats stats;
+    uint64_t cycle = 0;
 
 public:
-    GameBoy(Args *args);
+    GameBoy(const GameBoyOptions &options);
     void run();
-    void tick();
+    void run_frame();
+    void run_cycles(int cycles);
+    bool step_back();
+    void set_buttons(u8 mask);
+    void set_render_every(int n);
+    SDL_Surface *framebuffer();
+    int audio_samples(StereoSample *samples, int count);
+    void save_state(std::vector<u8> &out);
+    void save_state(const std::string &path);
+    void load_state(const u8 *data, size_t len);
+    void load_state(const std::vector<u8> &state);
+    void load_state(const std::string &path);
+    void detach();
+    const std::vector<FrameStats> &frame_stats();
+
+private:
+    void tick(int max_cycles);
+    void load_state(StateReader *in);
 };
 
 #endif // ROSETTABOY_GAMEBOY_H
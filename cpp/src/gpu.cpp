@@ -1,20 +1,23 @@
 #include <SDL2/SDL.h>
+#include <algorithm>
+#include <cstring>
 
 #include "consts.h"
 #include "gpu.h"
+#include "tiles.h"
 
-u16 SCALE = 2;
+const u16 SCALE = 2;
 
 #if SDL_BYTEORDER == SDL_BIG_ENDIAN
-u32 rmask = 0xff000000;
-u32 gmask = 0x00ff0000;
-u32 bmask = 0x0000ff00;
-u32 amask = 0x000000ff;
+const u32 rmask = 0xff000000;
+const u32 gmask = 0x00ff0000;
+const u32 bmask = 0x0000ff00;
+const u32 amask = 0x000000ff;
 #else
-u32 rmask = 0x000000ff;
-u32 gmask = 0x0000ff00;
-u32 bmask = 0x00ff0000;
-u32 amask = 0xff000000;
+const u32 rmask = 0x000000ff;
+const u32 gmask = 0x0000ff00;
+const u32 bmask = 0x00ff0000;
+const u32 amask = 0xff000000;
 #endif
 
 GPU::GPU(CPU *cpu, char *title, bool headless, bool debug) {
@@ -57,17 +60,51 @@ GPU::GPU(CPU *cpu, char *title, bool headless, bool debug) {
     this->colors[1] = {.r = 0x8B, .g = 0xAC, .b = 0x0F, .a = 0xFF};
     this->colors[2] = {.r = 0x30, .g = 0x62, .b = 0x30, .a = 0xFF};
     this->colors[3] = {.r = 0x0F, .g = 0x38, .b = 0x0F, .a = 0xFF};
+    this->update_palettes();
     // printf("SDL_Init failed: %s\n", SDL_GetError());
 };
 
 GPU::~GPU() {
+    SDL_DestroyRenderer(this->renderer);
     SDL_FreeSurface(this->buffer);
-    if(this->hw_window) SDL_DestroyWindow(this->hw_window);
-    SDL_Quit();
+    if(this->hw_buffer) SDL_DestroyTexture(this->hw_buffer);
+    if(this->hw_renderer) SDL_DestroyRenderer(this->hw_renderer);
+    if(this->hw_window) {
+        SDL_DestroyWindow(this->hw_window);
+        SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    }
+}
+
+/**
+ * Carry on drawing into `buffer`, but forget about the window without
+ * closing it - for a forked copy of us, which shares the parent's
+ * connection to the display and mustn't send anything down it
+ */
+void GPU::detach() {
+    this->hw_window = nullptr;
+    this->hw_renderer = nullptr;
+    this->hw_buffer = nullptr;
+}
+
+/**
+ * Cycles in between events only repeat the register updates from the
+ * cycle before, so when catching up we only need to process the last one.
+ *
+ * Like the CPU, this is compiled separately for with and without debug
+ * output, so that the non-debug version has no debug checks per line.
+ */
+void GPU::tick(int cycles) {
+#ifdef ENABLE_DEBUG_SPECIALISATION
+    if(!this->debug) {
+        this->tick_cycles<false>(cycles);
+        return;
+    }
+#endif
+    this->tick_cycles<true>(cycles);
 }
 
-void GPU::tick() {
-    this->cycle++;
+template <bool debug_gpu> void GPU::tick_cycles(int cycles) {
+    this->cycle += cycles;
 
     // CPU STOP stops all LCD activity until a button is pressed
     if(this->cpu->stop) {
@@ -80,7 +117,7 @@ void GPU::tick() {
         // When LCD is re-enabled, LY is 0
         // Does it become 0 as soon as disabled??
         this->cpu->ram->set(Mem::LY, 0);
-        if(!this->debug) {
+        if(!(debug_gpu && this->debug)) {
             return;
         }
     }
@@ -109,23 +146,29 @@ void GPU::tick() {
         }
     } else if(lx == 20 && ly < 144) {
         stat |= Stat::DRAWING;
-        if(ly == 0) {
-            // TODO: how often should we update palettes?
-            // Should every pixel reference them directly?
-            this->update_palettes();
-            auto c = this->bgp[0];
-            SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
-            SDL_RenderClear(this->renderer);
-        }
-        this->draw_line(ly);
-        if(ly == 143) {
-            if(this->debug) {
-                this->draw_debug();
+        bool render = (debug_gpu && this->debug) ||
+                      (this->render_every > 0 && (this->cycle / (114 * 154)) % this->render_every == 0);
+        if(render) {
+            if(ly == 0) {
+                // TODO: how often should we update palettes?
+                // Should every pixel reference them directly?
+                this->update_palettes();
+                // Every line of the screen is redrawn in full, but the
+                // debug panel only draws over parts of itself
+                if(debug_gpu && this->debug) {
+                    SDL_FillRect(this->buffer, NULL, this->bgp[0]);
+                }
             }
-            if(this->hw_renderer) {
-                SDL_UpdateTexture(this->hw_buffer, NULL, this->buffer->pixels, this->buffer->pitch);
-                SDL_RenderCopy(this->hw_renderer, this->hw_buffer, NULL, NULL);
-                SDL_RenderPresent(this->hw_renderer);
+            this->draw_line<debug_gpu>(ly);
+            if(ly == 143) {
+                if(debug_gpu && this->debug) {
+                    this->draw_debug();
+                }
+                if(this->hw_renderer) {
+                    SDL_UpdateTexture(this->hw_buffer, NULL, this->buffer->pixels, this->buffer->pitch);
+                    SDL_RenderCopy(this->hw_renderer, this->hw_buffer, NULL, NULL);
+                    SDL_RenderPresent(this->hw_renderer);
+                }
             }
         }
     } else if(lx == 63 && ly < 144) {
@@ -143,26 +186,50 @@ void GPU::tick() {
     this->cpu->ram->set(Mem::STAT, stat);
 }
 
+/**
+ * LY changes at lx=0, the STAT mode is set at lx=0/20/63, and the
+ * mode bits get cleared on the cycle after each of those
+ */
+int GPU::cycles_until_event() {
+    const u8 events[] = {0, 1, 20, 21, 63, 64, 114};
+    int lx = this->cycle % 114;
+    for(u8 event : events) {
+        if(event > lx) return event - lx;
+    }
+    return 1;
+}
+
+/**
+ * Along with the cycle, the palettes are state because they're only
+ * picked up from the registers at the start of each frame
+ */
+void GPU::save_state(StateWriter *out) {
+    out->put(this->cycle);
+    out->put(this->bgp);
+    out->put(this->obp0);
+    out->put(this->obp1);
+}
+
+void GPU::load_state(StateReader *in) {
+    in->get(this->cycle);
+    in->get(this->bgp);
+    in->get(this->obp0);
+    in->get(this->obp1);
+}
+
 void GPU::update_palettes() {
     u8 raw_bgp = this->cpu->ram->get(Mem::BGP);
-    this->bgp[0] = this->colors[(raw_bgp >> 0) & 0x3];
-    this->bgp[1] = this->colors[(raw_bgp >> 2) & 0x3];
-    this->bgp[2] = this->colors[(raw_bgp >> 4) & 0x3];
-    this->bgp[3] = this->colors[(raw_bgp >> 6) & 0x3];
-
     u8 raw_obp0 = this->cpu->ram->get(Mem::OBP0);
-    this->obp0[0] = this->colors[(raw_obp0 >> 0) & 0x3];
-    this->obp0[1] = this->colors[(raw_obp0 >> 2) & 0x3];
-    this->obp0[2] = this->colors[(raw_obp0 >> 4) & 0x3];
-    this->obp0[3] = this->colors[(raw_obp0 >> 6) & 0x3];
-
     u8 raw_obp1 = this->cpu->ram->get(Mem::OBP1);
-    this->obp1[0] = this->colors[(raw_obp1 >> 0) & 0x3];
-    this->obp1[1] = this->colors[(raw_obp1 >> 2) & 0x3];
-    this->obp1[2] = this->colors[(raw_obp1 >> 4) & 0x3];
-    this->obp1[3] = this->colors[(raw_obp1 >> 6) & 0x3];
+    for(int i = 0; i < 4; i++) {
+        this->bgp[i] = this->map_color(this->colors[(raw_bgp >> (i * 2)) & 0x3]);
+        this->obp0[i] = this->map_color(this->colors[(raw_obp0 >> (i * 2)) & 0x3]);
+        this->obp1[i] = this->map_color(this->colors[(raw_obp1 >> (i * 2)) & 0x3]);
+    }
 }
 
+u32 GPU::map_color(SDL_Color c) { return SDL_MapRGBA(this->buffer->format, c.r, c.g, c.b, c.a); }
+
 void GPU::draw_debug() {
     u8 lcdc = this->cpu->ram->get(Mem::LCDC);
 
@@ -173,7 +240,7 @@ void GPU::draw_debug() {
             .x = 160 + (tile_id % tile_display_width) * 8,
             .y = (tile_id / tile_display_width) * 8,
         };
-        this->paint_tile(tile_id, &xy, this->bgp, false, false);
+        this->paint_tile(tile_id, &xy, this->bgp);
     }
 
     // Background scroll border
@@ -191,150 +258,152 @@ void GPU::draw_debug() {
         SDL_SetRenderDrawColor(this->renderer, 0, 0, 255, 0xFF);
         SDL_RenderDrawRect(this->renderer, &rect);
     }
+
+    // Sprite outlines
+    if(lcdc & LCDC::OBJ_ENABLED) {
+        int height = (lcdc & LCDC::OBJ_SIZE) ? 16 : 8;
+        Sprite *oam = (Sprite *)&this->cpu->ram->data[Mem::OAM_BASE];
+        for(int n = 0; n < 40; n++) {
+            SDL_Rect rect = {.x = oam[n].x - 8, .y = oam[n].y - 16, .w = 8, .h = height};
+            auto c = gen_hue(oam[n].tile_id);
+            SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
+            SDL_RenderDrawRect(this->renderer, &rect);
+        }
+    }
 }
 
-void GPU::draw_line(i32 ly) {
+template <bool debug_gpu> void GPU::draw_line(i32 ly) {
     auto lcdc = this->cpu->ram->get(Mem::LCDC);
+    u32 *pixels = (u32 *)this->buffer->pixels + ly * (this->buffer->pitch / 4);
+    u8 *tile_px = nullptr;
 
-    // Background tiles
+    // Background and window are resolved to colour indices first, because
+    // sprites which are behind the background only show through colour 0
     if(lcdc & LCDC::BG_WIN_ENABLED) {
         auto scroll_y = this->cpu->ram->get(Mem::SCY);
         auto scroll_x = this->cpu->ram->get(Mem::SCX);
         auto tile_offset = !(lcdc & LCDC::DATA_SRC);
         auto tile_map = (lcdc & LCDC::BG_MAP) ? Mem::MAP_1 : Mem::MAP_0;
 
-        if(this->debug) {
-            SDL_Point xy = {.x = 256 - scroll_x, .y = ly};
-            SDL_SetRenderDrawColor(this->renderer, 255, 0, 0, 0xFF);
-            SDL_RenderDrawPoint(this->renderer, xy.x, xy.y);
-        }
-
         auto y_in_bgmap = (ly + scroll_y) % 256;
         auto tile_y = y_in_bgmap / 8;
         auto tile_sub_y = y_in_bgmap % 8;
 
-        for(int lx = 0; lx <= 160; lx += 8) {
+        for(int lx = 0; lx < 160; lx++) {
             auto x_in_bgmap = (lx + scroll_x) % 256;
-            auto tile_x = x_in_bgmap / 8;
             auto tile_sub_x = x_in_bgmap % 8;
-
-            i16 tile_id = this->cpu->ram->get(tile_map + tile_y * 32 + tile_x);
-            if(tile_offset && tile_id < 0x80) {
-                tile_id += 0x100;
+            if(lx == 0 || tile_sub_x == 0) {
+                i16 tile_id = this->cpu->ram->get(tile_map + tile_y * 32 + x_in_bgmap / 8);
+                if(tile_offset && tile_id < 0x80) {
+                    tile_id += 0x100;
+                }
+                tile_px = this->tile_line(tile_id, tile_sub_y);
             }
-            SDL_Point xy = {
-                .x = lx - tile_sub_x,
-                .y = ly - tile_sub_y,
-            };
-            this->paint_tile_line(tile_id, &xy, this->bgp, false, false, tile_sub_y);
+            this->line_bg[lx] = tile_px[tile_sub_x];
         }
-    }
 
-    // Window tiles
-    if(lcdc & LCDC::WINDOW_ENABLED) {
+        // Window tiles
         auto wnd_y = this->cpu->ram->get(Mem::WY);
-        auto wnd_x = this->cpu->ram->get(Mem::WX);
-        auto tile_offset = !(lcdc & LCDC::DATA_SRC);
-        auto tile_map = (lcdc & LCDC::WINDOW_MAP) ? Mem::MAP_1 : Mem::MAP_0;
-
-        // blank out the background
-        SDL_Rect rect = {
-            .x = wnd_x - 7,
-            .y = wnd_y,
-            .w = 160,
-            .h = 144,
-        };
-        auto c = this->bgp[0];
-        SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
-        SDL_RenderFillRect(this->renderer, &rect);
-
-        auto y_in_bgmap = ly - wnd_y;
-        auto tile_y = y_in_bgmap / 8;
-        auto tile_sub_y = y_in_bgmap % 8;
-
-        for(int tile_x = 0; tile_x < 20; tile_x++) {
-            auto tile_id = this->cpu->ram->get(tile_map + tile_y * 32 + tile_x);
-            if(tile_offset && tile_id < 0x80) {
-                tile_id += 0x100;
+        if((lcdc & LCDC::WINDOW_ENABLED) && ly >= wnd_y) {
+            auto wnd_x = this->cpu->ram->get(Mem::WX) - 7;
+            auto tile_map = (lcdc & LCDC::WINDOW_MAP) ? Mem::MAP_1 : Mem::MAP_0;
+
+            auto y_in_wndmap = ly - wnd_y;
+            auto tile_y = y_in_wndmap / 8;
+            auto tile_sub_y = y_in_wndmap % 8;
+
+            for(int lx = std::max(wnd_x, 0); lx < 160; lx++) {
+                auto x_in_wndmap = lx - wnd_x;
+                auto tile_sub_x = x_in_wndmap % 8;
+                if(lx == std::max(wnd_x, 0) || tile_sub_x == 0) {
+                    i16 tile_id = this->cpu->ram->get(tile_map + tile_y * 32 + x_in_wndmap / 8);
+                    if(tile_offset && tile_id < 0x80) {
+                        tile_id += 0x100;
+                    }
+                    tile_px = this->tile_line(tile_id, tile_sub_y);
+                }
+                this->line_bg[lx] = tile_px[tile_sub_x];
             }
-            SDL_Point xy = {
-                .x = tile_x * 8 + wnd_x - 7,
-                .y = tile_y * 8 + wnd_y,
-            };
-            this->paint_tile_line(tile_id, &xy, this->bgp, false, false, tile_sub_y);
         }
+    } else {
+        memset(this->line_bg, 0, sizeof(this->line_bg));
     }
 
+    Tiles::map_palette(this->line_bg, 160, this->bgp, pixels);
+
     // Sprites
     if(lcdc & LCDC::OBJ_ENABLED) {
-        auto dbl = lcdc & LCDC::OBJ_SIZE;
-
-        // TODO: sorted by x
-        // auto sprites: [Sprite; 40] = [];
-        // memcpy(sprites, &ram.data[OAM_BASE], 40 * sizeof(Sprite));
-        // for sprite in sprites.iter() {
-        for(int n = 0; n < 40; n++) {
-            Sprite sprite;
-            sprite.y = this->cpu->ram->get(Mem::OAM_BASE + 4 * n + 0);
-            sprite.x = this->cpu->ram->get(Mem::OAM_BASE + 4 * n + 1);
-            sprite.tile_id = this->cpu->ram->get(Mem::OAM_BASE + 4 * n + 2);
-            sprite.flags = this->cpu->ram->get(Mem::OAM_BASE + 4 * n + 3);
-
-            if(sprite.is_live()) {
-                auto palette = sprite.palette ? this->obp1 : this->obp0;
-                // printf("Drawing sprite %d (from %04X) at %d,%d\n", tile_id, OAM_BASE + (sprite_id * 4) + 0, x, y);
-                SDL_Point xy = {
-                    .x = sprite.x - 8,
-                    .y = sprite.y - 16,
-                };
-                this->paint_tile(sprite.tile_id, &xy, palette, sprite.x_flip, sprite.y_flip);
-
-                if(dbl) {
-                    xy.y = sprite.y - 8;
-                    this->paint_tile(sprite.tile_id + 1, &xy, palette, sprite.x_flip, sprite.y_flip);
-                }
+        int height = (lcdc & LCDC::OBJ_SIZE) ? 16 : 8;
+
+        // Only the first 10 sprites in OAM which touch this line are drawn,
+        // and where they overlap, the one with the lowest x wins (with OAM
+        // order as the tie-breaker)
+        Sprite *oam = (Sprite *)&this->cpu->ram->data[Mem::OAM_BASE];
+        Sprite *sprites[10];
+        int n_sprites = 0;
+        for(int n = 0; n < 40 && n_sprites < 10; n++) {
+            int row = ly - (oam[n].y - 16);
+            if(row >= 0 && row < height) {
+                sprites[n_sprites++] = &oam[n];
+            }
+        }
+        std::stable_sort(sprites, sprites + n_sprites, [](Sprite *a, Sprite *b) { return a->x < b->x; });
+
+        // A sprite claims a pixel even if it is hidden behind the background,
+        // so lower-priority sprites don't show through it
+        bool claimed[160] = {};
+        for(int n = 0; n < n_sprites; n++) {
+            Sprite *sprite = sprites[n];
+            auto palette = sprite->palette ? this->obp1 : this->obp0;
+            int row = ly - (sprite->y - 16);
+            if(sprite->y_flip) {
+                row = height - 1 - row;
+            }
+            i16 tile_id = height == 16 ? (sprite->tile_id & 0xFE) : sprite->tile_id;
+            tile_px = this->tile_line(tile_id + row / 8, row % 8);
+
+            for(int x = 0; x < 8; x++) {
+                int lx = sprite->x - 8 + x;
+                if(lx < 0 || lx >= 160 || claimed[lx]) continue;
+                // pallette #0 = transparent, so don't draw anything
+                u8 px = tile_px[sprite->x_flip ? 7 - x : x];
+                if(px == 0) continue;
+                claimed[lx] = true;
+                if(sprite->behind && this->line_bg[lx] != 0) continue;
+                pixels[lx] = palette[px];
             }
         }
     }
+
+    if(debug_gpu && this->debug) {
+        auto scroll_x = this->cpu->ram->get(Mem::SCX);
+        SDL_Point xy = {.x = 256 - scroll_x, .y = ly};
+        SDL_SetRenderDrawColor(this->renderer, 255, 0, 0, 0xFF);
+        SDL_RenderDrawPoint(this->renderer, xy.x, xy.y);
+    }
 }
 
-void GPU::paint_tile(i16 tile_id, SDL_Point *offset, SDL_Color *palette, bool flip_x, bool flip_y) {
+void GPU::paint_tile(i16 tile_id, SDL_Point *offset, u32 *palette) {
     for(int y = 0; y < 8; y++) {
-        this->paint_tile_line(tile_id, offset, palette, flip_x, flip_y, y);
+        if(offset->y + y >= this->buffer->h) break;
+        u32 *pixels = (u32 *)this->buffer->pixels + (offset->y + y) * (this->buffer->pitch / 4) + offset->x;
+        Tiles::map_palette(this->tile_line(tile_id, y), 8, palette, pixels);
     }
 
-    if(this->debug) {
-        SDL_Rect rect = {
-            .x = offset->x,
-            .y = offset->y,
-            .w = 8,
-            .h = 8,
-        };
-        auto c = gen_hue(tile_id);
-        SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
-        SDL_RenderDrawRect(this->renderer, &rect);
-    }
+    SDL_Rect rect = {
+        .x = offset->x,
+        .y = offset->y,
+        .w = 8,
+        .h = 8,
+    };
+    auto c = gen_hue(tile_id);
+    SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
+    SDL_RenderDrawRect(this->renderer, &rect);
 }
 
-void GPU::paint_tile_line(i16 tile_id, SDL_Point *offset, SDL_Color *palette, bool flip_x, bool flip_y, i32 y) {
-    u16 addr = (Mem::TILE_DATA + tile_id * 16 + y * 2);
-    u8 low_byte = this->cpu->ram->get(addr);
-    u8 high_byte = this->cpu->ram->get(addr + 1);
-    for(int x = 0; x < 8; x++) {
-        u8 low_bit = (low_byte >> (7 - x)) & 0x01;
-        u8 high_bit = (high_byte >> (7 - x)) & 0x01;
-        u8 px = (high_bit << 1) | low_bit;
-        // pallette #0 = transparent, so don't draw anything
-        if(px > 0) {
-            SDL_Point xy = {
-                .x = offset->x + (flip_x ? 7 - x : x),
-                .y = offset->y + (flip_y ? 7 - y : y),
-            };
-            auto c = palette[px];
-            SDL_SetRenderDrawColor(this->renderer, c.r, c.g, c.b, c.a);
-            SDL_RenderDrawPoint(this->renderer, xy.x, xy.y);
-        }
-    }
+void GPU::decode_tile(i16 tile_id) {
+    Tiles::decode_rows(&this->cpu->ram->data[Mem::TILE_DATA + tile_id * 16], 8, &this->tiles[tile_id][0][0]);
+    this->cpu->ram->tile_dirty[tile_id] = false;
 }
 
 SDL_Color gen_hue(u8 n) {
@@ -353,5 +422,3 @@ SDL_Color gen_hue(u8 n) {
         default: return {.r = 255, .g = 0, .b = q, .a = 0xFF};
     }
 }
-
-bool Sprite::is_live() { return x > 0 && x < 168 && y > 0 && y < 160; }
\ No newline at end of file
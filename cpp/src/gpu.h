@@ -44,8 +44,6 @@ struct Sprite {
             unsigned char behind : 1;
         };
     };
-
-    bool is_live();
 };
 
 class GPU {
@@ -54,26 +52,50 @@ private:
     SDL_Window *hw_window;
     SDL_Texture *hw_buffer;
     SDL_Renderer *hw_renderer;
-    SDL_Surface *buffer;
     SDL_Renderer *renderer;
     SDL_Color colors[4];
-    SDL_Color bgp[4], obp0[4], obp1[4];
-    int cycle;
+    u32 bgp[4], obp0[4], obp1[4];
+    // Colour index of each background / window pixel in the current line
+    u8 line_bg[160];
+    // Colour index of each pixel of each tile, refreshed when RAM
+    // marks the tile as dirty
+    u8 tiles[384][8][8];
+    uint64_t cycle = 0;
     CPU *cpu;
 
 public:
+    // The most recently drawn frame - 160x144, or wider with --debug-gpu
+    SDL_Surface *buffer;
+    // Draw every Nth frame, or nothing if 0 - LY, STAT and interrupts
+    // carry on as normal either way
+    int render_every = 1;
+
     GPU(CPU *cpu, char *title, bool headless, bool debug);
     ~GPU();
-    void tick();
+    void tick(int cycles);
+    int cycles_until_event();
+    void detach();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
 
 private:
+    template <bool debug_gpu> void tick_cycles(int cycles);
     void update_palettes();
+    u32 map_color(SDL_Color c);
     void draw_debug();
-    void draw_line(i32 ly);
-    void paint_tile(i16 tile_id, SDL_Point *offset, SDL_Color *palette, bool flip_x, bool flip_y);
-    void paint_tile_line(i16 tile_id, SDL_Point *offset, SDL_Color *palette, bool flip_x, bool flip_y, i32 y);
+    template <bool debug_gpu> void draw_line(i32 ly);
+    void paint_tile(i16 tile_id, SDL_Point *offset, u32 *palette);
+    inline u8 *tile_line(i16 tile_id, i32 y);
+    void decode_tile(i16 tile_id);
 };
 
 SDL_Color gen_hue(u8 n);
 
+inline u8 *GPU::tile_line(i16 tile_id, i32 y) {
+    if(this->cpu->ram->tile_dirty[tile_id]) {
+        this->decode_tile(tile_id);
+    }
+    return this->tiles[tile_id][y];
+}
+
 #endif // ROSETTABOY_GPU_H
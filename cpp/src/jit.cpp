@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "jit.h"
+
+// How many times a block has to be run by the interpreter before it's compiled
+const u16 HOT = 16;
+// Marks a block which starts with an instruction we can't compile
+const u16 NEVER = 0xFFFF;
+const int MAX_BLOCK_INSTRUCTIONS = 64;
+const size_t CODE_SIZE = 16 * 1024 * 1024;
+// Enough room for the largest possible block
+const size_t MAX_BLOCK_SIZE = 64 * 1024;
+
+JIT::JIT(CPU *cpu, bool debug) {
+    this->cpu = cpu;
+    this->debug = debug;
+    // Never writable and executable at once - compile() makes the part
+    // it's writing to writable, and then executable again when it's done
+    void *code = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code != MAP_FAILED) this->code = (u8 *)code;
+
+    u8 *base = (u8 *)cpu;
+    u8 *regs[] = {&cpu->B, &cpu->C, &cpu->D, &cpu->E, &cpu->H, &cpu->L, nullptr, &cpu->A};
+    for(int i = 0; i < 8; i++) {
+        this->reg8[i] = regs[i] ? regs[i] - base : -1;
+    }
+    this->reg16[0] = (u8 *)&cpu->BC - base;
+    this->reg16[1] = (u8 *)&cpu->DE - base;
+    this->reg16[2] = (u8 *)&cpu->HL - base;
+    this->reg16[3] = (u8 *)&cpu->SP - base;
+    this->pc = (u8 *)&cpu->PC - base;
+}
+
+JIT::~JIT() {
+    if(this->code) munmap(this->code, CODE_SIZE);
+}
+
+/**
+ * If the instruction at PC starts a compiled block, and the block can
+ * run without anything else happening part-way through, then run it.
+ *
+ * `cycles` is how many cycles we can run before another subsystem
+ * needs to catch up, not counting the one the CPU has already spent
+ * starting this instruction. Returns how many cycles the instructions
+ * took (including that one), or 0 if the interpreter should run them.
+ */
+int JIT::run(int cycles) {
+    int offset = this->cpu->ram->rom_offset(this->cpu->PC);
+    if(offset < 0 || !this->code) return 0;
+
+    Entry *e = this->entry(offset);
+    if(!e->block) {
+        if(e->hits == NEVER || ++e->hits < HOT) return 0;
+        if(!this->compile(offset)) return 0;
+        e = this->entry(offset);
+    }
+    // The same part of the cart can appear at two addresses, if bank 0 is
+    // switched in as the upper bank - blocks only run from where they were
+    // compiled, since they know their own addresses
+    if(e->addr != this->cpu->PC) return 0;
+    if(e->cycles - 1 > cycles) return 0;
+    if(e->cycles - 1 >= this->cpu->timer->cycles_until_interrupt()) return 0;
+    return e->block(this->cpu);
+}
+
+JIT::Entry *JIT::entry(int offset) {
+    auto &bank = this->entries[offset / ROM_BANK_SIZE];
+    if(!bank) bank = std::make_unique<Entry[]>(ROM_BANK_SIZE);
+    return &bank[offset % ROM_BANK_SIZE];
+}
+
+/**
+ * Translate instructions starting at PC (which is `offset` bytes into the
+ * cart) until we get to a jump, or to an instruction which only the
+ * interpreter can run.
+ *
+ * The generated code keeps a pointer to the CPU in rbx, and does most of
+ * its work by calling helpers with (cpu, opcode, argument) - only simple
+ * loads and stores between registers are done inline. If an instruction
+ * fails its check(), the block sets PC to that instruction and returns
+ * how many cycles it took to get there.
+ */
+bool JIT::compile(int offset) {
+    if(this->code_used + MAX_BLOCK_SIZE > CODE_SIZE) {
+        for(auto &bank : this->entries) bank.reset();
+        this->code_used = 0;
+    }
+
+    u16 start = this->cpu->PC;
+    u8 *block = this->code + this->code_used;
+    if(!this->protect(block, MAX_BLOCK_SIZE, PROT_READ | PROT_WRITE)) return false;
+    struct Exit {
+        u8 *jump;
+        u16 addr;
+        u16 cycles;
+    } exits[MAX_BLOCK_INSTRUCTIONS];
+    int n_exits = 0;
+
+    // push rbx; mov rbx, rdi
+    this->emit({0x53, 0x48, 0x89, 0xFB});
+
+    u16 addr = start;
+    int cycles = 0;
+    bool ended = false;
+    for(int i = 0; i < MAX_BLOCK_INSTRUCTIONS && !ended; i++) {
+        Decoded ins = this->cpu->decode(addr);
+        if((addr & (ROM_BANK_SIZE - 1)) + ins.len > ROM_BANK_SIZE) break;
+        u32 arg = ins.len == 2 ? ins.arg.as_u8 : ins.arg.as_u16;
+        u16 next = addr + ins.len;
+        u8 op = ins.op;
+        int dst = this->reg8[(op >> 3) & 0x07];
+        int src = this->reg8[op & 0x07];
+
+        bool jump = false;
+        Helper helper = JIT::helper(op, &jump);
+        bool native = op == 0x00 || op == 0x18 || op == 0xC3 ||
+                      (op >= 0x40 && op <= 0x7F && op != 0x76 && dst >= 0 && src >= 0) ||
+                      ((op & 0xC7) == 0x06 && dst >= 0) || (op & 0xCF) == 0x01 || (op & 0xC7) == 0x03;
+        if(!native && !helper) break;
+        // Accesses to fixed addresses which will never be safe (almost always
+        // I/O registers) are left to the interpreter from the start
+        if(op == 0xF0 && !JIT::can_read(this->cpu, 0xFF00 + arg)) break;
+        if(op == 0xE0 && !JIT::can_write(this->cpu, 0xFF00 + arg)) break;
+        if(op == 0xFA && arg >= 0xFF00 && !JIT::can_read(this->cpu, arg)) break;
+        if((op == 0xEA || op == 0x08) && (arg < 0x8000 || arg >= 0xFF00) && !JIT::can_write(this->cpu, arg)) break;
+
+        if(JIT::needs_check(op, arg)) {
+            this->emit_call((void *)JIT::check, op, arg);
+            // test eax, eax; jnz exit
+            this->emit({0x85, 0xC0, 0x0F, 0x85});
+            exits[n_exits++] = {this->code + this->code_used, addr, (u16)cycles};
+            this->emit32(0);
+        }
+        if(this->debug) this->emit_call((void *)JIT::trace, addr, 0);
+
+        if(op >= 0x40 && op <= 0x7F && native) {
+            // movzx eax, byte [rbx+src]; mov [rbx+dst], al
+            this->emit({0x0F, 0xB6, 0x83});
+            this->emit32(src);
+            this->emit({0x88, 0x83});
+            this->emit32(dst);
+        } else if((op & 0xC7) == 0x06 && native) {
+            // mov byte [rbx+dst], n
+            this->emit({0xC6, 0x83});
+            this->emit32(dst);
+            this->emit({(u8)arg});
+        } else if((op & 0xCF) == 0x01) {
+            // mov word [rbx+rr], nn
+            this->emit({0x66, 0xC7, 0x83});
+            this->emit32(this->reg16[op >> 4]);
+            this->emit16(arg);
+        } else if((op & 0xC7) == 0x03) {
+            // inc / dec word [rbx+rr]
+            this->emit({0x66, 0xFF, (u8)(op & 0x08 ? 0x8B : 0x83)});
+            this->emit32(this->reg16[op >> 4]);
+        } else if(op == 0x18) {
+            this->emit_store_pc(next + (i8)arg);
+            jump = true;
+        } else if(op == 0xC3) {
+            this->emit_store_pc(arg);
+            jump = true;
+        } else if(op != 0x00) {
+            // Jumps need to know where the next instruction is
+            if(jump) this->emit_store_pc(next);
+            this->emit_call((void *)helper, op, arg);
+        }
+
+        cycles += ins.cycles + 1;
+        addr = next;
+        ended = jump;
+    }
+
+    if(cycles == 0) {
+        this->code_used = block - this->code;
+        this->entry(offset)->hits = NEVER;
+        // The block before this one may share its last page with us
+        this->protect(block, 0, PROT_READ | PROT_EXEC);
+        return false;
+    }
+
+    // Ran to the end: mov eax, cycles; pop rbx; ret
+    if(!ended) this->emit_store_pc(addr);
+    this->emit({0xB8});
+    this->emit32(cycles);
+    this->emit({0x5B, 0xC3});
+
+    // Stopped part-way: leave PC at the instruction which couldn't run
+    for(int i = 0; i < n_exits; i++) {
+        u8 *here = this->code + this->code_used;
+        *(u32 *)exits[i].jump = here - (exits[i].jump + 4);
+        this->emit_store_pc(exits[i].addr);
+        this->emit({0xB8});
+        this->emit32(exits[i].cycles);
+        this->emit({0x5B, 0xC3});
+    }
+
+    if(!this->protect(block, this->code + this->code_used - block, PROT_READ | PROT_EXEC)) return false;
+    Entry *e = this->entry(offset);
+    e->block = (Block)block;
+    e->addr = start;
+    e->cycles = cycles;
+    return true;
+}
+
+/**
+ * Change the protection of the pages holding [start, start + len), and
+ * the page holding `start` even if len is 0. If that fails (eg because
+ * the OS won't let us have executable memory), the JIT gives up and
+ * leaves everything to the interpreter from then on.
+ */
+bool JIT::protect(u8 *start, size_t len, int prot) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = (uintptr_t)start & ~(page - 1);
+    uintptr_t to = ((uintptr_t)start + std::max(len, (size_t)1) + page - 1) & ~(page - 1);
+    if(mprotect((void *)from, to - from, prot) == 0) return true;
+    for(auto &bank : this->entries) bank.reset();
+    munmap(this->code, CODE_SIZE);
+    this->code = nullptr;
+    return false;
+}
+
+void JIT::emit(std::initializer_list<u8> bytes) {
+    for(u8 byte : bytes) {
+        this->code[this->code_used++] = byte;
+    }
+}
+
+void JIT::emit16(u16 val) { this->emit({(u8)val, (u8)(val >> 8)}); }
+
+void JIT::emit32(u32 val) {
+    this->emit16(val);
+    this->emit16(val >> 16);
+}
+
+void JIT::emit64(uint64_t val) {
+    this->emit32(val);
+    this->emit32(val >> 32);
+}
+
+void JIT::emit_store_pc(u16 addr) {
+    // mov word [rbx+PC], addr
+    this->emit({0x66, 0xC7, 0x83});
+    this->emit32(this->pc);
+    this->emit16(addr);
+}
+
+void JIT::emit_call(void *fn, u32 op, u32 arg) {
+    // mov rdi, rbx; mov esi, op; mov edx, arg; mov rax, helper; call rax
+    this->emit({0x48, 0x89, 0xDF, 0xBE});
+    this->emit32(op);
+    this->emit({0xBA});
+    this->emit32(arg);
+    this->emit({0x48, 0xB8});
+    this->emit64((uint64_t)fn);
+    this->emit({0xFF, 0xD0});
+}
+
+/**
+ * Which helper runs a given opcode (and whether it's a jump, which ends the
+ * block) - or nullptr if it can only be run by the interpreter, eg anything
+ * which changes the interrupt state, or HALT
+ */
+JIT::Helper JIT::helper(u8 op, bool *jump) {
+    *jump = false;
+    switch(op) {
+        case 0x40 ... 0x75:
+        case 0x77 ... 0x7F: return JIT::ld_r_r;
+        case 0x36: return JIT::ld_hl_n;
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+            return JIT::inc_dec_r;
+        case 0x80 ... 0x87: return JIT::alu_r<&CPU::_add>;
+        case 0x88 ... 0x8F: return JIT::alu_r<&CPU::_adc>;
+        case 0x90 ... 0x97: return JIT::alu_r<&CPU::_sub>;
+        case 0x98 ... 0x9F: return JIT::alu_r<&CPU::_sbc>;
+        case 0xA0 ... 0xA7: return JIT::alu_r<&CPU::_and>;
+        case 0xA8 ... 0xAF: return JIT::alu_r<&CPU::_xor>;
+        case 0xB0 ... 0xB7: return JIT::alu_r<&CPU::_or>;
+        case 0xB8 ... 0xBF: return JIT::alu_r<&CPU::_cp>;
+        case 0xC6: return JIT::alu_n<&CPU::_add>;
+        case 0xCE: return JIT::alu_n<&CPU::_adc>;
+        case 0xD6: return JIT::alu_n<&CPU::_sub>;
+        case 0xDE: return JIT::alu_n<&CPU::_sbc>;
+        case 0xE6: return JIT::alu_n<&CPU::_and>;
+        case 0xEE: return JIT::alu_n<&CPU::_xor>;
+        case 0xF6: return JIT::alu_n<&CPU::_or>;
+        case 0xFE: return JIT::alu_n<&CPU::_cp>;
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A: case 0xF0: case 0xFA: return JIT::ld_a_mem;
+        case 0x02: case 0x12: case 0x22: case 0x32: case 0xE0: case 0xEA: return JIT::ld_mem_a;
+        case 0x08: return JIT::ld_nn_sp;
+        case 0x09: case 0x19: case 0x29: case 0x39: return JIT::add_hl_rr;
+        case 0x07: case 0x0F: case 0x17: case 0x1F: return JIT::rotate_a;
+        case 0x2F: case 0x37: case 0x3F: case 0xF9: return JIT::misc;
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5: return JIT::push_rr;
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1: return JIT::pop_rr;
+        case 0xCB: return JIT::cb;
+        case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9:
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD:
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        case 0xE9:
+            *jump = true;
+            return JIT::jump;
+        default: return nullptr;
+    }
+}
+
+/**
+ * Whether a block can read `addr` without changing the order of events -
+ * the I/O registers are off-limits, since the timer and interrupt flags
+ * won't be up to date until the end of the block
+ */
+bool JIT::can_read(CPU *cpu, u16 addr) {
+    if(addr >= 0xFF00) return addr >= 0xFF80 && addr != Mem::IE;
+    return cpu->ram->is_mapped(addr, false);
+}
+
+/**
+ * Whether a block can write `addr` - which rules out the MBC registers
+ * (which would change the ROM under our feet), the I/O registers, and
+ * cart RAM which isn't there
+ */
+bool JIT::can_write(CPU *cpu, u16 addr) {
+    if(addr < 0x8000) return false;
+    if(addr >= 0xFF00) return addr >= 0xFF80 && addr != Mem::IE;
+    if(addr >= 0xA000 && addr < 0xC000) return cpu->ram->is_mapped(addr, true);
+    return true;
+}
+
+void JIT::trace(CPU *cpu, u32 addr, u32) {
+    cpu->PC = addr;
+    cpu->dump_regs();
+}
+
+/**
+ * Instructions which touch memory can only run if the memory is safe to
+ * touch mid-block (see can_read / can_write), which we won't know until we
+ * know what's in the registers - so these get a check() first, and if it
+ * fails then the block stops there and leaves the rest to the interpreter
+ */
+bool JIT::needs_check(u8 op, u8 arg) {
+    switch(op) {
+        case 0x40 ... 0x7F: return (op & 0x07) == 6 || (op & 0x38) == 0x30;
+        case 0x80 ... 0xBF: return (op & 0x07) == 6;
+        case 0xCB: return (arg & 0x07) == 6;
+        case 0x34: case 0x35: case 0x36:
+        case 0x0A: case 0x1A: case 0x2A: case 0x3A: case 0xF0: case 0xFA:
+        case 0x02: case 0x12: case 0x22: case 0x32: case 0xE0: case 0xEA: case 0x08:
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9:
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD:
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            return true;
+        default: return false;
+    }
+}
+
+int JIT::check(CPU *cpu, u32 op, u32 arg) {
+    u16 hl = cpu->HL;
+    u16 sp = cpu->SP;
+    switch(op) {
+        case 0x40 ... 0x7F:
+            return ((op & 0x07) == 6 && !can_read(cpu, hl)) || ((op & 0x38) == 0x30 && !can_write(cpu, hl));
+        case 0x80 ... 0xBF: return !can_read(cpu, hl);
+        // every CB op writes its result back, even BIT
+        case 0x34: case 0x35: case 0xCB: return !can_read(cpu, hl) || !can_write(cpu, hl);
+        case 0x36: return !can_write(cpu, hl);
+        case 0x0A: return !can_read(cpu, cpu->BC);
+        case 0x1A: return !can_read(cpu, cpu->DE);
+        case 0x2A: case 0x3A: return !can_read(cpu, hl);
+        case 0xF0: return !can_read(cpu, 0xFF00 + arg);
+        case 0xFA: return !can_read(cpu, arg);
+        case 0x02: return !can_write(cpu, cpu->BC);
+        case 0x12: return !can_write(cpu, cpu->DE);
+        case 0x22: case 0x32: return !can_write(cpu, hl);
+        case 0xE0: return !can_write(cpu, 0xFF00 + arg);
+        case 0xEA: return !can_write(cpu, arg);
+        case 0x08: return !can_write(cpu, arg) || !can_write(cpu, arg + 1);
+        // pop and return
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9:
+            return !can_read(cpu, sp) || !can_read(cpu, sp + 1);
+        // push, call and reset
+        default: return !can_write(cpu, sp - 1) || !can_write(cpu, sp - 2);
+    }
+}
+
+void JIT::ld_r_r(CPU *cpu, u32 op, u32) {
+    cpu->set_reg((op - 0x40) >> 3, cpu->get_reg(op - 0x40));
+}
+
+void JIT::ld_hl_n(CPU *cpu, u32, u32 arg) {
+    cpu->ram->set(cpu->HL, arg);
+}
+
+void JIT::inc_dec_r(CPU *cpu, u32 op, u32) {
+    u8 reg = (op >> 3) & 0x07;
+    u8 val = cpu->get_reg(reg);
+    cpu->set_reg(reg, (op & 0x07) == 0x04 ? cpu->_inc(val) : cpu->_dec(val));
+}
+
+template <void (CPU::*fn)(u8)> void JIT::alu_r(CPU *cpu, u32 op, u32) {
+    (cpu->*fn)(cpu->get_reg(op));
+}
+
+template <void (CPU::*fn)(u8)> void JIT::alu_n(CPU *cpu, u32, u32 arg) {
+    (cpu->*fn)(arg);
+}
+
+void JIT::ld_a_mem(CPU *cpu, u32 op, u32 arg) {
+    u16 addr = op == 0x0A ? cpu->BC : op == 0x1A ? cpu->DE : op == 0xFA ? arg : op == 0xF0 ? 0xFF00 + arg : cpu->HL;
+    cpu->A = cpu->ram->get(addr);
+    if(op == 0x2A) cpu->HL++;
+    if(op == 0x3A) cpu->HL--;
+}
+
+void JIT::ld_mem_a(CPU *cpu, u32 op, u32 arg) {
+    u16 addr = op == 0x02 ? cpu->BC : op == 0x12 ? cpu->DE : op == 0xEA ? arg : op == 0xE0 ? 0xFF00 + arg : cpu->HL;
+    cpu->ram->set(addr, cpu->A);
+    if(op == 0x22) cpu->HL++;
+    if(op == 0x32) cpu->HL--;
+}
+
+void JIT::ld_nn_sp(CPU *cpu, u32, u32 arg) {
+    cpu->ram->set(arg + 1, ((cpu->SP >> 8) & 0xFF));
+    cpu->ram->set(arg, (cpu->SP & 0xFF));
+}
+
+void JIT::add_hl_rr(CPU *cpu, u32 op, u32) {
+    u16 val16 = op == 0x09 ? cpu->BC : op == 0x19 ? cpu->DE : op == 0x29 ? cpu->HL : cpu->SP;
+    cpu->flags();
+    cpu->FLAG_H = ((cpu->HL & 0x0FFF) + (val16 & 0x0FFF) > 0x0FFF);
+    cpu->FLAG_C = (cpu->HL + val16 > 0xFFFF);
+    cpu->HL += val16;
+    cpu->FLAG_N = false;
+    cpu->flags_written();
+}
+
+void JIT::rotate_a(CPU *cpu, u32 op, u32) {
+    u8 carry = cpu->flags() & (1 << 4) ? 1 : 0;
+    if(op == 0x07) { // RCLA
+        cpu->FLAG_C = (cpu->A & (1 << 7)) != 0;
+        cpu->A = (cpu->A << 1) | (cpu->A >> 7);
+    }
+    if(op == 0x17) { // RLA
+        cpu->FLAG_C = (cpu->A & (1 << 7)) != 0;
+        cpu->A = (cpu->A << 1) | carry;
+    }
+    if(op == 0x0F) { // RRCA
+        cpu->FLAG_C = (cpu->A & (1 << 0)) != 0;
+        cpu->A = (cpu->A >> 1) | (cpu->A << 7);
+    }
+    if(op == 0x1F) { // RRA
+        cpu->FLAG_C = (cpu->A & (1 << 0)) != 0;
+        cpu->A = (cpu->A >> 1) | (carry << 7);
+    }
+    cpu->FLAG_N = false;
+    cpu->FLAG_H = false;
+    cpu->FLAG_Z = false;
+    cpu->flags_written();
+}
+
+void JIT::misc(CPU *cpu, u32 op, u32) {
+    cpu->flags();
+    switch(op) {
+        // clang-format off
+        case 0x2F: cpu->A ^= 0xFF; cpu->FLAG_N = true; cpu->FLAG_H = true; break;
+        case 0x37: cpu->FLAG_N = false; cpu->FLAG_H = false; cpu->FLAG_C = true; break;
+        case 0x3F: cpu->FLAG_C = !cpu->FLAG_C; cpu->FLAG_N = false; cpu->FLAG_H = false; break;
+        case 0xF9: cpu->SP = cpu->HL; break;
+            // clang-format on
+    }
+    cpu->flags_written();
+}
+
+void JIT::push_rr(CPU *cpu, u32 op, u32) {
+    if(op == 0xF5) cpu->flags();
+    cpu->push(op == 0xC5 ? cpu->BC : op == 0xD5 ? cpu->DE : op == 0xE5 ? cpu->HL : cpu->AF);
+}
+
+void JIT::pop_rr(CPU *cpu, u32 op, u32) {
+    u16 val = cpu->pop();
+    if(op == 0xC1) cpu->BC = val;
+    if(op == 0xD1) cpu->DE = val;
+    if(op == 0xE1) cpu->HL = val;
+    if(op == 0xF1) {
+        cpu->AF = val & 0xFFF0;
+        cpu->flags_written();
+    }
+}
+
+void JIT::cb(CPU *cpu, u32, u32 arg) {
+    cpu->tick_cb(arg);
+}
+
+/**
+ * Every kind of jump, call and return - PC has already been
+ * moved on to the next instruction
+ */
+void JIT::jump(CPU *cpu, u32 op, u32 arg) {
+    bool taken;
+    switch(op & 0x18) {
+        case 0x00: taken = !cpu->flag_z(); break;
+        case 0x08: taken = cpu->flag_z(); break;
+        case 0x10: taken = !cpu->flag_c(); break;
+        default: taken = cpu->flag_c(); break;
+    }
+    switch(op) {
+        case 0x20: case 0x28: case 0x30: case 0x38: // JR cc
+            if(taken) cpu->PC += (i8)arg;
+            break;
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc
+            if(taken) cpu->PC = arg;
+            break;
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: // RET cc
+            if(!taken) break;
+            // fall through
+        case 0xC9:
+            cpu->PC = cpu->pop();
+            break;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: // CALL cc
+            if(!taken) break;
+            // fall through
+        case 0xCD:
+            cpu->push(cpu->PC);
+            cpu->PC = arg;
+            break;
+        case 0xE9: cpu->PC = cpu->HL; break;
+        default: // RST
+            cpu->push(cpu->PC);
+            cpu->PC = op & 0x38;
+            break;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef ROSETTABOY_JIT_H
+#define ROSETTABOY_JIT_H
+
+#include <cstdint>
+#include <memory>
+
+#include "consts.h"
+
+class CPU;
+
+/**
+ * Translates hot blocks of ROM code into x86-64 machine code.
+ *
+ * A block runs straight through without letting the timer, DMA or
+ * interrupts catch up between instructions, and the CPU catches up
+ * on all of the block's cycles afterwards - so a block is only run
+ * when nothing could have happened in the meantime: it has to finish
+ * before the next event from another subsystem, and before the next
+ * timer interrupt. Any instruction which would touch MMIO or the MBC
+ * registers (where the order of events does matter) ends the block
+ * early, and is left for the interpreter to run.
+ *
+ * Blocks are found by where they are in the cart, like the CPU's
+ * decoded instructions, so switching banks doesn't invalidate them;
+ * and only ROM is compiled, so writes can't invalidate them either.
+ */
+class JIT {
+public:
+    JIT(CPU *cpu, bool debug);
+    ~JIT();
+    int run(int cycles);
+
+private:
+    typedef int (*Block)(CPU *cpu);
+    typedef void (*Helper)(CPU *cpu, u32 op, u32 arg);
+    struct Entry {
+        Block block;
+        u16 addr;
+        u16 cycles;
+        u16 hits;
+    };
+
+    CPU *cpu;
+    bool debug;
+    u8 *code = nullptr;
+    size_t code_used = 0;
+    // Compiled blocks (and how often the ones which haven't been
+    // compiled yet have been run), for each ROM bank
+    std::unique_ptr<Entry[]> entries[0x100];
+
+    // Where each register lives inside CPU
+    int reg8[8];
+    int reg16[4];
+    int pc;
+
+    Entry *entry(int offset);
+    bool compile(int offset);
+    bool protect(u8 *start, size_t len, int prot);
+
+    void emit(std::initializer_list<u8> bytes);
+    void emit16(u16 val);
+    void emit32(u32 val);
+    void emit64(uint64_t val);
+    void emit_store_pc(u16 addr);
+    void emit_call(void *fn, u32 op, u32 arg);
+
+    static Helper helper(u8 op, bool *jump);
+    static bool can_read(CPU *cpu, u16 addr);
+    static bool can_write(CPU *cpu, u16 addr);
+    static bool needs_check(u8 op, u8 arg);
+    static int check(CPU *cpu, u32 op, u32 arg);
+    static void trace(CPU *cpu, u32 addr, u32);
+    static void ld_r_r(CPU *cpu, u32 op, u32);
+    static void ld_hl_n(CPU *cpu, u32 op, u32 arg);
+    static void inc_dec_r(CPU *cpu, u32 op, u32);
+    template <void (CPU::*fn)(u8)> static void alu_r(CPU *cpu, u32 op, u32);
+    template <void (CPU::*fn)(u8)> static void alu_n(CPU *cpu, u32 op, u32 arg);
+    static void ld_a_mem(CPU *cpu, u32 op, u32 arg);
+    static void ld_mem_a(CPU *cpu, u32 op, u32 arg);
+    static void ld_nn_sp(CPU *cpu, u32 op, u32 arg);
+    static void add_hl_rr(CPU *cpu, u32 op, u32);
+    static void rotate_a(CPU *cpu, u32 op, u32);
+    static void misc(CPU *cpu, u32 op, u32);
+    static void push_rr(CPU *cpu, u32 op, u32);
+    static void pop_rr(CPU *cpu, u32 op, u32);
+    static void cb(CPU *cpu, u32 op, u32 arg);
+    static void jump(CPU *cpu, u32 op, u32 arg);
+};
+
+#endif // ROSETTABOY_JIT_H
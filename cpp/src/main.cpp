@@ -2,6 +2,7 @@
 #include "errors.h"
 #include "gameboy.h"
 #include <iostream>
+#include <memory>
 
 int main(int argc, char *argv[]) {
     Args *args = new Args(argc, argv);
@@ -9,8 +10,14 @@ int main(int argc, char *argv[]) {
         return args->exit_code;
     }
 
+    // Headless, nothing reads SDL's events - so rather than Ctrl-C being
+    // turned into a quit event that never arrives, let it stop us as usual
+    if(args->headless) SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
+
     try {
-        GameBoy *gameboy = new GameBoy(args);
+        // Owned here, so that it's cleaned up (eg its --audio-out file is
+        // finished) on the way out, however that happens
+        auto gameboy = std::make_unique<GameBoy>(*args);
         gameboy->run();
     } catch(UnitTestFailed *e) {
         std::cout << e->what() << std::endl;
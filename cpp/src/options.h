@@ -0,0 +1,48 @@
+#ifndef ROSETTABOY_OPTIONS_H
+#define ROSETTABOY_OPTIONS_H
+
+#include <string>
+
+/**
+ * Everything needed to set up a GameBoy - the command line fills
+ * this in from Args, and library users can fill it in directly
+ */
+struct GameBoyOptions {
+    std::string rom;
+    // A boot ROM to run before the game, if the file exists - otherwise
+    // a minimal built-in one sets up the registers and jumps to the game
+    std::string boot;
+    bool headless = false;
+    bool silent = false;
+    // Keep cart RAM in a .sav file next to the ROM - if false, every
+    // run starts with empty cart RAM
+    bool save = true;
+    // Play sound through an SDL audio device - if false, the caller
+    // pulls samples with GameBoy::audio_samples() instead
+    bool audio_device = true;
+    // Samples per second of sound generated, whether it's played or pulled
+    int audio_rate = 48000;
+    // Write sound to this file (.wav, or raw PCM for any other name)
+    // rather than playing it - this turns sound on even if `silent` is set
+    std::string audio_out;
+    bool debug_cpu = false;
+    bool debug_gpu = false;
+    bool debug_apu = false;
+    bool debug_ram = false;
+    // Stop (by throwing Timeout) after this many frames / seconds, 0 = never
+    int frames = 0;
+    int profile = 0;
+    bool turbo = false;
+    int render_every = 1;
+    // Keep the last N seconds of frames for stepping back through with
+    // GameBoy::step_back() (0 = off), in at most this many MB
+    int rewind = 0;
+    int rewind_memory = 64;
+    // Echo bytes the game sends over the serial port to stdout
+    bool print_serial = true;
+    // Write per-frame timings and counters here (JSON, or CSV for a .csv
+    // name) when the GameBoy is destroyed - only with ENABLE_STATS
+    std::string stats;
+};
+
+#endif // ROSETTABOY_OPTIONS_H
@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "ram.h"
 
 /**
@@ -5,7 +7,7 @@
  * the canonical ROM and then gets out of the way - no
  * logo scrolling or DRM.
  */
-u8 BOOT[0x100] = {
+const u8 BOOT[0x100] = {
     // prod memory
     0x31, 0xFE, 0xFF, // LD SP,$FFFE
 
@@ -31,28 +33,292 @@ u8 BOOT[0x100] = {
     0xC3, 0xFD, 0x00, // JP 0x00FD
 };
 
-RAM::RAM(Cart *cart, bool debug) {
+RAM::RAM(Cart *cart, std::string boot, bool debug) {
     this->debug = debug;
     this->cart = cart;
-    this->boot = BOOT;
+    memcpy(this->boot, BOOT, sizeof(this->boot));
+
+    // Fresh pages from the OS are zeroed, but reused heap memory isn't,
+    // so clear it for the same start state every time
+    memset(this->data, 0, sizeof(this->data));
 
     // this instruction must be at the end of ROM --
     // after these finish executing, PC needs to be 0x100
-    BOOT[0xFE] = 0xE0; // LDH 50,A (disable boot rom)
-    BOOT[0xFF] = 0x50;
+    this->boot[0xFE] = 0xE0; // LDH 50,A (disable boot rom)
+    this->boot[0xFF] = 0x50;
 
     // Load a real bootloader if available
-    FILE *fp = fopen("boot.gb", "rb");
+    FILE *fp = boot.empty() ? nullptr : fopen(boot.c_str(), "rb");
     if(fp) {
-        fread(&BOOT, 1, 0x100, fp);
+        fread(this->boot, 1, 0x100, fp);
         fclose(fp);
 
         // NOP the DRM
-        BOOT[0xE9] = 0x00;
-        BOOT[0xEA] = 0x00;
-        BOOT[0xFA] = 0x00;
-        BOOT[0xFB] = 0x00;
+        this->boot[0xE9] = 0x00;
+        this->boot[0xEA] = 0x00;
+        this->boot[0xFA] = 0x00;
+        this->boot[0xFB] = 0x00;
+    }
+
+    // Nothing has been decoded yet
+    for(int tile_id = 0; tile_id < 384; tile_id++) {
+        this->tile_dirty[tile_id] = true;
+    }
+
+    this->update_pages();
+}
+
+u8 RAM::get_special(u16 addr) {
+    u8 val = this->data[addr];
+    switch(addr) {
+        case 0x0000 ... 0x3FFF: {
+            // ROM bank 0
+            if(this->data[Mem::BOOT] == 0 && addr < 0x0100) {
+                val = this->boot[addr];
+            } else {
+                val = this->cart->data[addr];
+            }
+            break;
+        }
+        case 0x4000 ... 0x7FFF: {
+            // Switchable ROM bank
+            int bank = this->rom_bank * ROM_BANK_SIZE;
+            int offset = addr - 0x4000;
+            // printf("fetching %04X from bank %04X (total = %04X)\n", offset, bank, offset + bank);
+            val = this->cart->data[bank + offset];
+            break;
+        }
+        case 0x8000 ... 0x9FFF:
+            // VRAM
+            break;
+        case 0xA000 ... 0xBFFF: {
+            // 8KB Switchable RAM bank
+            if(!this->ram_enable) {
+                printf("ERR: Reading from external ram while disabled: %04X\n", addr);
+                return 0;
+            }
+            int bank = this->ram_bank * RAM_BANK_SIZE;
+            int offset = addr - 0xA000;
+            if(bank + offset >= this->cart->ram_size) {
+                throw new InvalidRamRead(this->ram_bank, offset, this->cart->ram_size);
+            }
+            val = this->cart->ram[bank + offset];
+            break;
+        }
+        case 0xC000 ... 0xCFFF:
+            // work RAM, bank 0
+            break;
+        case 0xD000 ... 0xDFFF:
+            // work RAM, bankable in CGB
+            break;
+        case 0xE000 ... 0xFDFF: {
+            // ram[E000-FE00] mirrors ram[C000-DE00]
+            val = this->data[addr - 0x2000];
+            break;
+        }
+        case 0xFE00 ... 0xFE9F:
+            // Sprite attribute table
+            break;
+        case 0xFEA0 ... 0xFEFF:
+            // Unusable
+            val = 0xFF;
+            break;
+        case 0xFF00 ... 0xFF7F:
+            // GPU Registers
+            break;
+        case 0xFF80 ... 0xFFFE:
+            // High RAM
+            break;
+        case 0xFFFF:
+            // IE Register
+            break;
+    }
+
+    if(this->debug) {
+        printf("ram[%04X] -> %02X\n", addr, val);
+    }
+    return val;
+}
+
+void RAM::set_special(u16 addr, u8 val) {
+    if(this->debug) {
+        printf("ram[%04X] <- %02X\n", addr, val);
+    }
+    switch(addr) {
+        case 0x0000 ... 0x1FFF: {
+            bool newval = (val != 0);
+            // if(this->ram_enable != newval) printf("ram_enable set to %d\n", newval);
+            if(this->ram_enable != newval) {
+                this->ram_enable = newval;
+                this->update_pages();
+            }
+            break;
+        }
+        case 0x2000 ... 0x3FFF: {
+            this->rom_bank_low = val;
+            this->rom_bank = (this->rom_bank_high << 5) | this->rom_bank_low;
+            if(this->debug) printf("rom_bank set to %u/%u\n", this->rom_bank, this->cart->rom_size / ROM_BANK_SIZE);
+            if(this->rom_bank * ROM_BANK_SIZE > this->cart->rom_size) {
+                throw std::invalid_argument("Set rom_bank beyond the size of ROM");
+            }
+            this->update_pages();
+            break;
+        }
+        case 0x4000 ... 0x5FFF: {
+            if(this->ram_bank_mode) {
+                this->ram_bank = val;
+                if(this->debug) printf("ram_bank set to %u/%u\n", this->ram_bank, this->cart->ram_size / RAM_BANK_SIZE);
+                if(this->ram_bank * RAM_BANK_SIZE > this->cart->ram_size) {
+                    throw std::invalid_argument("Set ram_bank beyond the size of RAM");
+                }
+            } else {
+                this->rom_bank_high = val;
+                this->rom_bank = (this->rom_bank_high << 5) | this->rom_bank_low;
+                if(this->debug) printf("rom_bank set to %u/%u\n", this->rom_bank, this->cart->rom_size / ROM_BANK_SIZE);
+                if(this->rom_bank * ROM_BANK_SIZE > this->cart->rom_size) {
+                    throw std::invalid_argument("Set rom_bank beyond the size of ROM");
+                }
+            }
+            this->update_pages();
+            break;
+        }
+        case 0x6000 ... 0x7FFF: {
+            this->ram_bank_mode = (val != 0);
+            // printf("ram_bank_mode set to %d\n", this->ram_bank_mode);
+            break;
+        }
+        case 0x8000 ... 0x97FF:
+            // VRAM tile data
+            this->tile_dirty[(addr - 0x8000) / 16] = true;
+            break;
+        case 0x9800 ... 0x9FFF:
+            // VRAM tile maps
+            break;
+        case 0xA000 ... 0xBFFF: {
+            // external RAM, bankable
+            if(!this->ram_enable) {
+                // printf("ERR: Writing to external ram while disabled: %04X=%02X\n", addr, val);
+                return;
+            }
+            int bank = this->ram_bank * RAM_BANK_SIZE;
+            int offset = addr - 0xA000;
+            if(this->debug)
+                printf("Writing external RAM: %04X=%02X (%02X:%04X)\n", bank + offset, val, this->ram_bank, offset);
+            if(bank + offset >= this->cart->ram_size) {
+                throw new InvalidRamWrite(this->ram_bank, offset, this->cart->ram_size);
+            }
+            this->cart->ram[bank + offset] = val;
+            break;
+        }
+        case 0xC000 ... 0xCFFF:
+            // work RAM, bank 0
+            break;
+        case 0xD000 ... 0xDFFF:
+            // work RAM, bankable in CGB
+            break;
+        case 0xE000 ... 0xFDFF: {
+            // ram[E000-FE00] mirrors ram[C000-DE00]
+            this->data[addr - 0x2000] = val;
+            break;
+        }
+        case 0xFE00 ... 0xFE9F:
+            // Sprite attribute table
+            break;
+        case 0xFEA0 ... 0xFEFF:
+            // Unusable
+            // printf("Writing to invalid ram: %04X = %02X\n", addr, val);
+            // throw std::invalid_argument("Writing to invalid RAM");
+            break;
+        case 0xFF00 ... 0xFF7F:
+            // GPU Registers
+            if(addr == Mem::JOYP || addr == Mem::IF || (addr >= Mem::LCDC && addr <= Mem::LYC)) {
+                this->sync_needed = true;
+            }
+            if(addr >= Mem::DIV && addr <= Mem::TAC) {
+                this->timer_written = true;
+                if(addr == Mem::DIV) this->div_reset = true;
+            }
+            if(addr >= Mem::NR10 && addr <= Mem::WAVE + 15 && this->defer_sound_writes && !this->sound_written) {
+                this->sound_written = true;
+                this->sound_write_addr = addr;
+                this->sound_write_val = val;
+                this->sync_needed = true;
+                return;
+            }
+            break;
+        case 0xFF80 ... 0xFFFE:
+            // High RAM
+            break;
+        case 0xFFFF:
+            // IE Register
+            break;
+    }
+
+    this->data[addr] = val;
+
+    // Writing to BOOT unmaps the boot ROM
+    if(addr == Mem::BOOT) {
+        this->update_pages();
+    }
+}
+
+/**
+ * Point each page of the address space at the memory which backs
+ * it, so that get() and set() can skip the special cases. Pages which
+ * do need special handling - or all pages, when debugging - are left
+ * as nullptr.
+ *
+ * Called again whenever the banking registers change.
+ */
+void RAM::update_pages() {
+    for(int page = 0x00; page <= 0xFF; page++) {
+        this->read_pages[page] = nullptr;
+        this->write_pages[page] = nullptr;
+    }
+    if(this->debug) return;
+
+    // ROM bank 0, with the boot ROM on top of it until it's disabled
+    this->read_pages[0x00] = this->data[Mem::BOOT] == 0 ? this->boot : this->cart->data;
+    for(int page = 0x01; page <= 0x3F; page++) {
+        this->read_pages[page] = &this->cart->data[page << 8];
+    }
+
+    // Switchable ROM bank
+    for(int page = 0x40; page <= 0x7F; page++) {
+        this->read_pages[page] = &this->cart->data[this->rom_bank * ROM_BANK_SIZE + ((page - 0x40) << 8)];
+    }
+
+    // VRAM and work RAM - tile data writes are special because they
+    // need to mark the tile as dirty
+    for(int page = 0x80; page <= 0x9F; page++) {
+        this->read_pages[page] = &this->data[page << 8];
+        if(page >= 0x98) this->write_pages[page] = &this->data[page << 8];
+    }
+    for(int page = 0xC0; page <= 0xDF; page++) {
+        this->read_pages[page] = &this->data[page << 8];
+        this->write_pages[page] = &this->data[page << 8];
     }
+
+    // External RAM, if it's enabled and the bank exists
+    for(int page = 0xA0; page <= 0xBF; page++) {
+        int offset = this->ram_bank * RAM_BANK_SIZE + ((page - 0xA0) << 8);
+        if(this->ram_enable && offset < (int)this->cart->ram_size) {
+            this->read_pages[page] = &this->cart->ram[offset];
+            this->write_pages[page] = &this->cart->ram[offset];
+        }
+    }
+
+    // Echo RAM is read-only here because writes need to update both copies
+    for(int page = 0xE0; page <= 0xFD; page++) {
+        this->read_pages[page] = &this->data[(page << 8) - 0x2000];
+    }
+
+    // OAM is writable, but reads from the unusable area after it are special
+    this->write_pages[0xFE] = &this->data[0xFE00];
+
+    // I/O registers and high RAM can be read directly, but some
+    // registers need extra handling when written to
+    this->read_pages[0xFF] = &this->data[0xFF00];
 }
 
 void RAM::dump() {
@@ -60,3 +326,55 @@ void RAM::dump() {
     fwrite(this->data, sizeof(u8), 0xFFFF + 1, fp);
     fclose(fp);
 }
+
+/**
+ * Banking registers, the address space, and cart RAM
+ */
+void RAM::save_state(StateWriter *out) {
+    out->put(this->ram_enable);
+    out->put(this->ram_bank_mode);
+    out->put(this->rom_bank_low);
+    out->put(this->rom_bank_high);
+    out->put(this->rom_bank);
+    out->put(this->ram_bank);
+    out->put(this->data, sizeof(this->data));
+    out->put(this->cart->ram, this->cart->ram_size);
+}
+
+void RAM::load_state(StateReader *in) {
+    bool ram_enable, ram_bank_mode;
+    u8 rom_bank_low, rom_bank_high, rom_bank, ram_bank;
+    in->read(ram_enable);
+    in->read(ram_bank_mode);
+    in->read(rom_bank_low);
+    in->read(rom_bank_high);
+    in->read(rom_bank);
+    in->read(ram_bank);
+    // The pages for the switchable banks point straight into the cart
+    if((rom_bank + 1) * ROM_BANK_SIZE > (int)this->cart->rom_size) {
+        throw new InvalidSaveState("ROM bank is beyond the end of the ROM");
+    }
+    if(ram_bank && ram_bank * RAM_BANK_SIZE >= (int)this->cart->ram_size) {
+        throw new InvalidSaveState("cart RAM bank is beyond the end of cart RAM");
+    }
+    in->get(this->data, sizeof(this->data));
+    in->get(this->cart->ram, this->cart->ram_size);
+    if(in->checking) return;
+
+    this->ram_enable = ram_enable;
+    this->ram_bank_mode = ram_bank_mode;
+    this->rom_bank_low = rom_bank_low;
+    this->rom_bank_high = rom_bank_high;
+    this->rom_bank = rom_bank;
+    this->ram_bank = ram_bank;
+
+    // The GPU's decoded tiles are for the old VRAM
+    for(int tile_id = 0; tile_id < 384; tile_id++) {
+        this->tile_dirty[tile_id] = true;
+    }
+    this->sync_needed = false;
+    this->timer_written = false;
+    this->div_reset = false;
+    this->sound_written = false;
+    this->update_pages();
+}
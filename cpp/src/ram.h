@@ -6,6 +6,8 @@
 #include "cart.h"
 #include "consts.h"
 #include "errors.h"
+#include "state.h"
+#include "stats.h"
 
 const u16 ROM_BANK_SIZE = 0x4000;
 const u16 RAM_BANK_SIZE = 0x2000;
@@ -19,13 +21,41 @@ private:
     u8 rom_bank_high = 0;
     u8 rom_bank = 1;
     u8 ram_bank = 0;
-    u8 *boot;
+    u8 boot[0x100];
     bool debug = false;
 
+    // Each 256-byte page of the address space points straight at the
+    // memory which backs it, or is nullptr if it needs special handling
+    u8 *read_pages[0x100];
+    u8 *write_pages[0x100];
+
 public:
-    RAM(Cart *cart, bool debug);
+    RAM(Cart *cart, std::string boot, bool debug);
     u8 data[0xFFFF + 1];
+    // Set when a register that other subsystems watch is written to,
+    // so that they can catch up with the CPU before it carries on
+    bool sync_needed = false;
+    // Set when a write lands in one of the 384 tiles in 0x8000-0x97FF,
+    // so that the GPU knows to re-decode it
+    bool tile_dirty[384];
+    // Set when DIV, TIMA, TMA or TAC are written to, so that the timer
+    // knows to pick up the change (and when DIV is, to reset its counter)
+    bool timer_written = false;
+    bool div_reset = false;
+    // If set, writes to the sound registers are held back until the APU
+    // has caught up to the cycle they happen on (using the old values),
+    // and then the APU applies them - so only one can be pending at once,
+    // and the CPU stops to let the APU catch up as soon as there is one
+    bool defer_sound_writes = false;
+    bool sound_written = false;
+    u16 sound_write_addr = 0;
+    u8 sound_write_val = 0;
+#ifdef ENABLE_STATS
+    MemoryCounts counts;
+#endif
     void dump();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
 
     /**
      * Inline these in the header because many calls
@@ -34,173 +64,48 @@ public:
 public:
     inline u8 get(u16 addr);
     inline void set(u16 addr, u8 val);
+    inline int rom_offset(u16 addr);
+    inline bool is_mapped(u16 addr, bool write);
+
+private:
+    u8 get_special(u16 addr);
+    void set_special(u16 addr, u8 val);
+    void update_pages();
 };
 
 inline u8 RAM::get(u16 addr) {
-    u8 val = this->data[addr];
-    switch(addr) {
-        case 0x0000 ... 0x3FFF: {
-            // ROM bank 0
-            if(this->data[Mem::BOOT] == 0 && addr < 0x0100) {
-                val = this->boot[addr];
-            } else {
-                val = this->cart->data[addr];
-            }
-            break;
-        }
-        case 0x4000 ... 0x7FFF: {
-            // Switchable ROM bank
-            int bank = this->rom_bank * ROM_BANK_SIZE;
-            int offset = addr - 0x4000;
-            // printf("fetching %04X from bank %04X (total = %04X)\n", offset, bank, offset + bank);
-            val = this->cart->data[bank + offset];
-            break;
-        }
-        case 0x8000 ... 0x9FFF:
-            // VRAM
-            break;
-        case 0xA000 ... 0xBFFF: {
-            // 8KB Switchable RAM bank
-            if(!this->ram_enable) {
-                printf("ERR: Reading from external ram while disabled: %04X\n", addr);
-                return 0;
-            }
-            int bank = this->ram_bank * RAM_BANK_SIZE;
-            int offset = addr - 0xA000;
-            if(bank + offset >= this->cart->ram_size) {
-                throw new InvalidRamRead(this->ram_bank, offset, this->cart->ram_size);
-            }
-            val = this->cart->ram[bank + offset];
-            break;
-        }
-        case 0xC000 ... 0xCFFF:
-            // work RAM, bank 0
-            break;
-        case 0xD000 ... 0xDFFF:
-            // work RAM, bankable in CGB
-            break;
-        case 0xE000 ... 0xFDFF: {
-            // ram[E000-FE00] mirrors ram[C000-DE00]
-            val = this->data[addr - 0x2000];
-            break;
-        }
-        case 0xFE00 ... 0xFE9F:
-            // Sprite attribute table
-            break;
-        case 0xFEA0 ... 0xFEFF:
-            // Unusable
-            val = 0xFF;
-            break;
-        case 0xFF00 ... 0xFF7F:
-            // GPU Registers
-            break;
-        case 0xFF80 ... 0xFFFE:
-            // High RAM
-            break;
-        case 0xFFFF:
-            // IE Register
-            break;
-    }
-
-    if(this->debug) {
-        printf("ram[%04X] -> %02X\n", addr, val);
-    }
-    return val;
+    STAT(this->counts.reads[Region::of(addr)]++);
+    u8 *page = this->read_pages[addr >> 8];
+    if(page) return page[addr & 0xFF];
+    return this->get_special(addr);
 }
 
 inline void RAM::set(u16 addr, u8 val) {
-    if(this->debug) {
-        printf("ram[%04X] <- %02X\n", addr, val);
-    }
-    switch(addr) {
-        case 0x0000 ... 0x1FFF: {
-            bool newval = (val != 0);
-            // if(this->ram_enable != newval) printf("ram_enable set to %d\n", newval);
-            this->ram_enable = newval;
-            break;
-        }
-        case 0x2000 ... 0x3FFF: {
-            this->rom_bank_low = val;
-            this->rom_bank = (this->rom_bank_high << 5) | this->rom_bank_low;
-            if(this->debug) printf("rom_bank set to %u/%u\n", this->rom_bank, this->cart->rom_size / ROM_BANK_SIZE);
-            if(this->rom_bank * ROM_BANK_SIZE > this->cart->rom_size) {
-                throw std::invalid_argument("Set rom_bank beyond the size of ROM");
-            }
-            break;
-        }
-        case 0x4000 ... 0x5FFF: {
-            if(this->ram_bank_mode) {
-                this->ram_bank = val;
-                if(this->debug) printf("ram_bank set to %u/%u\n", this->ram_bank, this->cart->ram_size / RAM_BANK_SIZE);
-                if(this->ram_bank * RAM_BANK_SIZE > this->cart->ram_size) {
-                    throw std::invalid_argument("Set ram_bank beyond the size of RAM");
-                }
-            } else {
-                this->rom_bank_high = val;
-                this->rom_bank = (this->rom_bank_high << 5) | this->rom_bank_low;
-                if(this->debug) printf("rom_bank set to %u/%u\n", this->rom_bank, this->cart->rom_size / ROM_BANK_SIZE);
-                if(this->rom_bank * ROM_BANK_SIZE > this->cart->rom_size) {
-                    throw std::invalid_argument("Set rom_bank beyond the size of ROM");
-                }
-            }
-            break;
-        }
-        case 0x6000 ... 0x7FFF: {
-            this->ram_bank_mode = (val != 0);
-            // printf("ram_bank_mode set to %d\n", this->ram_bank_mode);
-            break;
-        }
-        case 0x8000 ... 0x9FFF:
-            // VRAM
-            // TODO: if writing to tile RAM, update tiles in GPU class?
-            break;
-        case 0xA000 ... 0xBFFF: {
-            // external RAM, bankable
-            if(!this->ram_enable) {
-                // printf("ERR: Writing to external ram while disabled: %04X=%02X\n", addr, val);
-                return;
-            }
-            int bank = this->ram_bank * RAM_BANK_SIZE;
-            int offset = addr - 0xA000;
-            if(this->debug)
-                printf("Writing external RAM: %04X=%02X (%02X:%04X)\n", bank + offset, val, this->ram_bank, offset);
-            if(bank + offset >= this->cart->ram_size) {
-                throw new InvalidRamWrite(this->ram_bank, offset, this->cart->ram_size);
-            }
-            this->cart->ram[bank + offset] = val;
-            break;
-        }
-        case 0xC000 ... 0xCFFF:
-            // work RAM, bank 0
-            break;
-        case 0xD000 ... 0xDFFF:
-            // work RAM, bankable in CGB
-            break;
-        case 0xE000 ... 0xFDFF: {
-            // ram[E000-FE00] mirrors ram[C000-DE00]
-            this->data[addr - 0x2000] = val;
-            break;
-        }
-        case 0xFE00 ... 0xFE9F:
-            // Sprite attribute table
-            break;
-        case 0xFEA0 ... 0xFEFF:
-            // Unusable
-            // printf("Writing to invalid ram: %04X = %02X\n", addr, val);
-            // throw std::invalid_argument("Writing to invalid RAM");
-            break;
-        case 0xFF00 ... 0xFF7F:
-            // GPU Registers
-            break;
-        case 0xFF80 ... 0xFFFE:
-            // High RAM
-            break;
-        case 0xFFFF:
-            // IE Register
-            break;
+    STAT(this->counts.writes[Region::of(addr)]++);
+    u8 *page = this->write_pages[addr >> 8];
+    if(page) {
+        page[addr & 0xFF] = val;
+        return;
     }
+    this->set_special(addr, val);
+}
+
+/**
+ * Where the byte at `addr` lives in the cart's ROM, or -1 if the
+ * address isn't mapped straight to ROM (eg RAM, or the boot ROM)
+ */
+inline int RAM::rom_offset(u16 addr) {
+    u8 *page = this->read_pages[addr >> 8];
+    if(addr >= 0x8000 || page == nullptr || page == this->boot) return -1;
+    return page - this->cart->data + (addr & 0xFF);
+}
 
-    this->data[addr] = val;
+/**
+ * Whether get() / set() for `addr` go straight to memory,
+ * rather than via get_special() / set_special()
+ */
+inline bool RAM::is_mapped(u16 addr, bool write) {
+    return (write ? this->write_pages : this->read_pages)[addr >> 8] != nullptr;
 }
 
 #endif // ROSETTABOY_RAM_H
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "gameboy.h"
+#include "rewind.h"
+
+// A stretch of fewer unchanged bytes than this costs more to skip
+// over (with another header) than to store as part of a changed run
+const size_t MIN_SKIP = 8;
+
+Rewind::Rewind(size_t max_bytes, int max_frames, int keyframe_every) {
+    this->ring.resize(max_bytes);
+    this->max_frames = std::max(1, max_frames);
+    this->keyframe_every = std::max(1, keyframe_every);
+}
+
+/**
+ * Save the GameBoy's current state as the newest frame
+ */
+void Rewind::capture(GameBoy *gameboy) {
+    gameboy->save_state(this->state);
+    if(this->state.size() != this->state_len) {
+        this->entries.clear();
+        this->has_ref = false;
+        this->state_len = this->state.size();
+        this->zeros.assign(this->state_len, 0);
+    }
+
+    u32 frame = this->entries.empty() ? 0 : this->entries.back().frame + 1;
+    bool delta = !this->entries.empty() && this->has_ref && this->ref_frame == this->entries.back().keyframe &&
+                 frame - this->ref_frame < (u32)this->keyframe_every;
+    while(true) {
+        size_t len = encode(this->state, delta ? this->ref : this->zeros, this->encoded);
+        size_t at;
+        if(!this->make_room(len, &at)) return;
+        // Making room can push out the keyframe we were going to diff
+        // against, in which case we need to be a keyframe ourselves
+        if(delta && (this->entries.empty() || this->entries.front().frame > this->ref_frame)) {
+            delta = false;
+            continue;
+        }
+
+        memcpy(this->ring.data() + at, this->encoded.data(), len);
+        this->entries.push_back({at, (u32)len, frame, delta ? this->ref_frame : frame});
+        if(!delta) {
+            this->ref.swap(this->state);
+            this->ref_frame = frame;
+            this->has_ref = true;
+        }
+        return;
+    }
+}
+
+/**
+ * Load the newest frame back into the GameBoy, and forget it - returns
+ * false if there's nothing left to go back to
+ */
+bool Rewind::restore(GameBoy *gameboy) {
+    if(this->entries.empty()) return false;
+    this->decode_into(this->entries.back(), this->state);
+    gameboy->load_state(this->state);
+    this->entries.pop_back();
+    return true;
+}
+
+/**
+ * Forget the newest frame
+ */
+void Rewind::drop() {
+    if(!this->entries.empty()) this->entries.pop_back();
+}
+
+/**
+ * Find `len` contiguous bytes of the ring for the next frame, dropping
+ * the oldest frames to make space if need be. Returns false (and
+ * forgets everything, since there'd be a gap in the history otherwise)
+ * if the frame won't fit even into an empty ring.
+ */
+bool Rewind::make_room(size_t len, size_t *at) {
+    if(len > this->ring.size()) {
+        this->entries.clear();
+        return false;
+    }
+    while((int)this->entries.size() >= this->max_frames) this->drop_oldest();
+
+    while(!this->entries.empty()) {
+        size_t head = this->entries.front().at;
+        size_t tail = this->entries.back().at + this->entries.back().len;
+        if(head < tail) {
+            // Frames run from head to tail, so we can go after them, or
+            // wrap around to the start and go before them
+            if(this->ring.size() - tail >= len) {
+                *at = tail;
+                return true;
+            }
+            if(head >= len) {
+                *at = 0;
+                return true;
+            }
+        } else if(head - tail >= len) {
+            // Frames have already wrapped around, so the gap is between
+            // the newest and the oldest
+            *at = tail;
+            return true;
+        }
+        this->drop_oldest();
+    }
+    *at = 0;
+    return true;
+}
+
+/**
+ * Drop the oldest keyframe, and all of the frames which depend on it
+ */
+void Rewind::drop_oldest() {
+    do {
+        this->entries.pop_front();
+    } while(!this->entries.empty() && this->entries.front().keyframe != this->entries.front().frame);
+}
+
+void Rewind::decode_into(const Entry &entry, std::vector<u8> &out) {
+    if(!this->has_ref || this->ref_frame != entry.keyframe) {
+        const Entry &key = this->entries[entry.keyframe - this->entries.front().frame];
+        this->ref = this->zeros;
+        decode(this->ring.data() + key.at, key.len, this->ref);
+        this->ref_frame = key.frame;
+        this->has_ref = true;
+    }
+    out = this->ref;
+    if(entry.frame != entry.keyframe) decode(this->ring.data() + entry.at, entry.len, out);
+}
+
+/**
+ * Store `state` as a list of runs, each one a u32 count of bytes which
+ * are the same as in `ref`, a u32 count of
+ * bytes which aren't, and then those bytes XORed with `ref`. Returns how
+ * much of `out` was used - it's only ever grown, never shrunk, so that
+ * it doesn't get cleared every time.
+ */
+size_t Rewind::encode(const std::vector<u8> &state, const std::vector<u8> &ref, std::vector<u8> &out) {
+    const u8 *a = state.data();
+    const u8 *b = ref.data();
+    size_t n = state.size();
+    auto same = [a, b](size_t i) { return a[i] == b[i]; };
+    auto same8 = [a, b](size_t i) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        return x == y;
+    };
+
+    // Every run but the last is followed by at least MIN_SKIP unchanged
+    // bytes, so this is as big as the output can get
+    size_t max_len = n + n / MIN_SKIP * 8 + 8;
+    if(out.size() < max_len) out.resize(max_len);
+    u8 *o = out.data();
+    size_t i = 0;
+    while(i < n) {
+        size_t skip_from = i;
+        // Most of the state is unchanged, so skip over it as quickly as
+        // we can, and then narrow down to where it changes
+        while(i + 256 <= n && memcmp(a + i, b + i, 256) == 0) i += 256;
+        while(i + 8 <= n && same8(i)) i += 8;
+        while(i < n && same(i)) i++;
+        size_t diff_from = i;
+        while(i < n) {
+            if(!same(i)) {
+                i++;
+                continue;
+            }
+            size_t j = i;
+            while(j < n && j - i < MIN_SKIP && same(j)) j++;
+            if(j == n || j - i >= MIN_SKIP) break;
+            i = j;
+        }
+
+        u32 skip = diff_from - skip_from, diff = i - diff_from;
+        memcpy(o, &skip, 4);
+        memcpy(o + 4, &diff, 4);
+        o += 8;
+        for(size_t k = diff_from; k < i; k++) *o++ = a[k] ^ b[k];
+    }
+    return o - out.data();
+}
+
+/**
+ * XOR the runs from encode() into `out`, which should already hold the
+ * ref they were made against
+ */
+void Rewind::decode(const u8 *data, size_t len, std::vector<u8> &out) {
+    const u8 *end = data + len;
+    size_t at = 0;
+    while(data < end) {
+        u32 skip, diff;
+        memcpy(&skip, data, 4);
+        memcpy(&diff, data + 4, 4);
+        data += 8;
+        at += skip;
+        for(u32 k = 0; k < diff; k++) out[at + k] ^= data[k];
+        at += diff;
+        data += diff;
+    }
+}
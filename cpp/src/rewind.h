@@ -0,0 +1,68 @@
+#ifndef ROSETTABOY_REWIND_H
+#define ROSETTABOY_REWIND_H
+
+#include <deque>
+#include <vector>
+
+#include "consts.h"
+
+class GameBoy;
+
+/**
+ * The last few seconds of save states, one per frame, for stepping
+ * backwards through.
+ *
+ * A whole state is ~70KB, but from one frame to the next most of it
+ * stays the same - so every Kth frame is stored as a keyframe, and the
+ * frames in between are stored as the difference from their keyframe
+ * (XORed against it, with the runs of zeros that leaves squeezed out).
+ * Keyframes are stored the same way, as the difference from all-zeros,
+ * which squeezes out empty RAM. Restoring a frame means decoding at most
+ * one keyframe and one delta, however long ago the frame was.
+ *
+ * Everything lives in one buffer allocated up front, used as a ring:
+ * when it's full, or holds more than `max_frames` frames, the oldest
+ * keyframe is dropped along with the frames which depend on it.
+ */
+class Rewind {
+public:
+    Rewind(size_t max_bytes, int max_frames, int keyframe_every);
+    void capture(GameBoy *gameboy);
+    bool restore(GameBoy *gameboy);
+    void drop();
+    int frames() { return this->entries.size(); }
+
+private:
+    struct Entry {
+        size_t at;
+        u32 len;
+        // Which frame this is, and which keyframe it's a delta from
+        // (its own number if it is a keyframe)
+        u32 frame;
+        u32 keyframe;
+    };
+
+    std::vector<u8> ring;
+    std::deque<Entry> entries;
+    int max_frames;
+    int keyframe_every;
+
+    // Scratch space for the state being captured or restored, and
+    // the keyframe which deltas are currently being made against (with
+    // keyframes themselves made against all-zeros)
+    size_t state_len = 0;
+    std::vector<u8> zeros;
+    std::vector<u8> state;
+    std::vector<u8> ref;
+    bool has_ref = false;
+    u32 ref_frame = 0;
+    std::vector<u8> encoded;
+
+    bool make_room(size_t len, size_t *at);
+    void drop_oldest();
+    void decode_into(const Entry &entry, std::vector<u8> &out);
+    static size_t encode(const std::vector<u8> &state, const std::vector<u8> &ref, std::vector<u8> &out);
+    static void decode(const u8 *data, size_t len, std::vector<u8> &out);
+};
+
+#endif // ROSETTABOY_REWIND_H
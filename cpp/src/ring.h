@@ -0,0 +1,55 @@
+#ifndef ROSETTABOY_RING_H
+#define ROSETTABOY_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+/**
+ * A fixed-size queue for passing things from one thread to one other
+ * thread without locking - eg samples from the emulator to the audio
+ * device. Only the producer moves `head` and only the consumer moves
+ * `tail`, so each side only has to look at the other's position to
+ * know how much it can safely touch. The two positions live on
+ * separate cache lines, so that the threads aren't fighting over one.
+ */
+template <typename T, size_t N> class Ring {
+    static_assert((N & (N - 1)) == 0, "Ring size must be a power of two");
+
+public:
+    /**
+     * Producer: add up to `count` items, and return how many there
+     * was room for
+     */
+    size_t push(const T *src, size_t count) {
+        size_t head = this->head.load(std::memory_order_relaxed);
+        size_t tail = this->tail.load(std::memory_order_acquire);
+        count = std::min(count, N - (head - tail));
+        for(size_t i = 0; i < count; i++) {
+            this->items[(head + i) & (N - 1)] = src[i];
+        }
+        this->head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    /**
+     * Consumer: take up to `count` items, and return how many there were
+     */
+    size_t pop(T *dst, size_t count) {
+        size_t tail = this->tail.load(std::memory_order_relaxed);
+        size_t head = this->head.load(std::memory_order_acquire);
+        count = std::min(count, head - tail);
+        for(size_t i = 0; i < count; i++) {
+            dst[i] = this->items[(tail + i) & (N - 1)];
+        }
+        this->tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) T items[N];
+};
+
+#endif // ROSETTABOY_RING_H
@@ -0,0 +1,71 @@
+#ifndef ROSETTABOY_STATE_H
+#define ROSETTABOY_STATE_H
+
+#include <cstring>
+#include <vector>
+
+#include "consts.h"
+#include "errors.h"
+
+/**
+ * A save state is a small header followed by each subsystem's state,
+ * copied in and out field by field in a fixed order. There are no
+ * names or tags to parse, so restoring the same state over and over
+ * costs little more than copying RAM - but it also means a state can
+ * only be loaded by the same version of the emulator, running the
+ * same ROM, which the header checks.
+ */
+const u32 STATE_MAGIC = 0x53534252; // "RBSS"
+const u32 STATE_VERSION = 4;
+
+class StateWriter {
+public:
+    StateWriter(std::vector<u8> *out) { this->out = out; }
+    template <typename T> void put(const T &val) { this->put(&val, sizeof(T)); }
+    void put(const void *src, size_t len) {
+        size_t at = this->out->size();
+        this->out->resize(at + len);
+        memcpy(this->out->data() + at, src, len);
+    }
+    size_t size() { return this->out->size(); }
+    void patch(size_t at, u32 val) { memcpy(this->out->data() + at, &val, sizeof(val)); }
+
+private:
+    std::vector<u8> *out;
+};
+
+/**
+ * With `checking` set, get() only skips over each field - for a first
+ * pass which checks that a state is good before anything is overwritten.
+ * Values which need checking are read with read(), which always reads,
+ * and each load_state() stops before changing anything if `checking`.
+ */
+class StateReader {
+public:
+    StateReader(const u8 *data, size_t len, bool checking = false) {
+        this->at = data;
+        this->end = data + len;
+        this->checking = checking;
+    }
+    bool checking;
+    template <typename T> void get(T &val) { this->get(&val, sizeof(T)); }
+    void get(void *dst, size_t len) {
+        this->skip(len);
+        if(!this->checking) memcpy(dst, this->at - len, len);
+    }
+    template <typename T> void read(T &val) {
+        this->skip(sizeof(T));
+        memcpy(&val, this->at - sizeof(T), sizeof(T));
+    }
+    void skip(size_t len) {
+        if(len > (size_t)(this->end - this->at)) throw new InvalidSaveState("state is truncated");
+        this->at += len;
+    }
+    size_t remaining() { return this->end - this->at; }
+
+private:
+    const u8 *at;
+    const u8 *end;
+};
+
+#endif // ROSETTABOY_STATE_H
@@ -0,0 +1,127 @@
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+
+#include "stats.h"
+
+static const char *PART_NAMES[Part::COUNT] = {"cpu", "gpu", "apu", "input", "pacing"};
+static const char *REGION_NAMES[Region::COUNT] = {"rom", "vram", "cart_ram", "wram", "oam", "io", "hram"};
+
+Stats::Stats() {
+    this->start_ticks = now();
+    this->start_time = std::chrono::steady_clock::now();
+}
+
+/**
+ * Errors are only reported here rather than thrown, since we're most
+ * likely being destroyed because something else was thrown
+ */
+Stats::~Stats() {
+    if(!this->path.empty()) this->write(this->path);
+}
+
+/**
+ * Close the current frame - the timestamp counter's rate is worked out
+ * from how far it has gone since we started, which gets more accurate
+ * the longer we run
+ */
+void Stats::end_frame(CPUCounts &cpu, MemoryCounts &memory) {
+    auto elapsed = std::chrono::steady_clock::now() - this->start_time;
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    uint64_t ticks = now() - this->start_ticks;
+    double ns_per_tick = ticks ? ns / ticks : 1;
+
+    FrameStats frame;
+    for(int i = 0; i < Part::COUNT; i++) {
+        frame.ns[i] = this->ticks[i] * ns_per_tick;
+        this->ticks[i] = 0;
+    }
+    frame.cpu = cpu;
+    frame.memory = memory;
+    cpu = CPUCounts();
+    memory = MemoryCounts();
+    this->frames.push_back(frame);
+}
+
+FrameStats Stats::total() {
+    FrameStats t;
+    for(auto &f : this->frames) {
+        for(int i = 0; i < Part::COUNT; i++) t.ns[i] += f.ns[i];
+        t.cpu.instructions += f.cpu.instructions;
+        t.cpu.jit_blocks += f.cpu.jit_blocks;
+        t.cpu.interrupts += f.cpu.interrupts;
+        for(int i = 0; i < Region::COUNT; i++) {
+            t.memory.reads[i] += f.memory.reads[i];
+            t.memory.writes[i] += f.memory.writes[i];
+        }
+    }
+    return t;
+}
+
+/**
+ * JSON (totals, plus one object per frame), or CSV (one row per frame)
+ * if `path` ends in .csv
+ */
+void Stats::write(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if(!fp) {
+        fprintf(stderr, "Couldn't write stats to %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+    if(path.size() >= 4 && strcasecmp(path.c_str() + path.size() - 4, ".csv") == 0) {
+        this->write_csv(fp);
+    } else {
+        this->write_json(fp);
+    }
+    fclose(fp);
+}
+
+static void write_json_frame(FILE *fp, const FrameStats &f) {
+    fprintf(fp, "{\"ns\": {");
+    for(int i = 0; i < Part::COUNT; i++) {
+        fprintf(fp, "%s\"%s\": %lu", i ? ", " : "", PART_NAMES[i], (unsigned long)f.ns[i]);
+    }
+    fprintf(fp, "}, \"instructions\": %lu, \"jit_blocks\": %lu, \"interrupts\": %lu",
+            (unsigned long)f.cpu.instructions, (unsigned long)f.cpu.jit_blocks, (unsigned long)f.cpu.interrupts);
+    const uint64_t *counts[2] = {f.memory.reads, f.memory.writes};
+    const char *names[2] = {"reads", "writes"};
+    for(int n = 0; n < 2; n++) {
+        fprintf(fp, ", \"%s\": {", names[n]);
+        for(int i = 0; i < Region::COUNT; i++) {
+            fprintf(fp, "%s\"%s\": %lu", i ? ", " : "", REGION_NAMES[i], (unsigned long)counts[n][i]);
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+}
+
+void Stats::write_json(FILE *fp) {
+    fprintf(fp, "{\n\"total\": ");
+    write_json_frame(fp, this->total());
+    fprintf(fp, ",\n\"frames\": [");
+    for(size_t i = 0; i < this->frames.size(); i++) {
+        fprintf(fp, "%s\n", i ? "," : "");
+        write_json_frame(fp, this->frames[i]);
+    }
+    fprintf(fp, "\n]\n}\n");
+}
+
+void Stats::write_csv(FILE *fp) {
+    fprintf(fp, "frame");
+    for(int i = 0; i < Part::COUNT; i++) fprintf(fp, ",%s_ns", PART_NAMES[i]);
+    fprintf(fp, ",instructions,jit_blocks,interrupts");
+    for(int i = 0; i < Region::COUNT; i++) fprintf(fp, ",%s_reads", REGION_NAMES[i]);
+    for(int i = 0; i < Region::COUNT; i++) fprintf(fp, ",%s_writes", REGION_NAMES[i]);
+    fprintf(fp, "\n");
+
+    for(size_t n = 0; n < this->frames.size(); n++) {
+        const FrameStats &f = this->frames[n];
+        fprintf(fp, "%zu", n);
+        for(int i = 0; i < Part::COUNT; i++) fprintf(fp, ",%lu", (unsigned long)f.ns[i]);
+        fprintf(fp, ",%lu,%lu,%lu", (unsigned long)f.cpu.instructions, (unsigned long)f.cpu.jit_blocks,
+                (unsigned long)f.cpu.interrupts);
+        for(int i = 0; i < Region::COUNT; i++) fprintf(fp, ",%lu", (unsigned long)f.memory.reads[i]);
+        for(int i = 0; i < Region::COUNT; i++) fprintf(fp, ",%lu", (unsigned long)f.memory.writes[i]);
+        fprintf(fp, "\n");
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef ROSETTABOY_STATS_H
+#define ROSETTABOY_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "consts.h"
+
+/**
+ * Counting things costs time, so the counters are only compiled in with
+ * ENABLE_STATS (see build_stats.sh) - otherwise STAT(...) compiles to
+ * nothing, and GameBoy::frame_stats() is always empty.
+ */
+#ifdef ENABLE_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
+namespace Part {
+    enum Part {
+        CPU,
+        GPU,
+        APU,
+        INPUT,
+        PACING,
+        COUNT,
+    };
+}
+
+namespace Region {
+    enum Region {
+        ROM,
+        VRAM,
+        CART_RAM,
+        WRAM,
+        OAM,
+        IO,
+        HRAM,
+        COUNT,
+    };
+
+    inline Region of(u16 addr) {
+        if(addr < 0x8000) return ROM;
+        if(addr < 0xA000) return VRAM;
+        if(addr < 0xC000) return CART_RAM;
+        if(addr < 0xFE00) return WRAM; // including echo RAM
+        if(addr < 0xFF00) return OAM;  // including the unusable area after it
+        if(addr < 0xFF80 || addr == 0xFFFF) return IO;
+        return HRAM;
+    }
+}
+
+struct CPUCounts {
+    // Instructions run by the interpreter, and blocks run by the JIT
+    // (whose instructions aren't counted one by one)
+    uint64_t instructions = 0;
+    uint64_t jit_blocks = 0;
+    uint64_t interrupts = 0;
+};
+
+/**
+ * Accesses which go through RAM::get() / set() - the CPU's, and the other
+ * subsystems' reads of their registers and VRAM - which is everything
+ * except instructions fetched from the CPU's cache of decoded ROM, and
+ * loads and stores which the JIT compiles inline
+ */
+struct MemoryCounts {
+    uint64_t reads[Region::COUNT] = {};
+    uint64_t writes[Region::COUNT] = {};
+};
+
+struct FrameStats {
+    // Wall time spent in each part of GameBoy::tick(), in nanoseconds
+    uint64_t ns[Part::COUNT] = {};
+    CPUCounts cpu;
+    MemoryCounts memory;
+};
+
+/**
+ * Where the time goes, frame by frame. GameBoy::tick() takes a
+ * timestamp between each subsystem (with the CPU's timestamp counter
+ * where there is one, since that's a lot cheaper than asking the OS),
+ * and at the end of each frame the times are converted to nanoseconds
+ * and the CPU's and RAM's counters are collected.
+ */
+class Stats {
+public:
+    Stats();
+    ~Stats();
+    inline void start() { this->last = now(); }
+    inline void lap(Part::Part part) {
+        uint64_t t = now();
+        this->ticks[part] += t - this->last;
+        this->last = t;
+    }
+    void end_frame(CPUCounts &cpu, MemoryCounts &memory);
+    FrameStats total();
+    void write(const std::string &path);
+
+    std::vector<FrameStats> frames;
+    // Written out as JSON (or CSV, for a .csv name) when we're done
+    std::string path;
+
+private:
+    uint64_t last = 0;
+    uint64_t ticks[Part::COUNT] = {};
+    // For working out how long a tick is
+    uint64_t start_ticks;
+    std::chrono::steady_clock::time_point start_time;
+
+    static inline uint64_t now() {
+#if defined(__x86_64__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+    void write_json(FILE *fp);
+    void write_csv(FILE *fp);
+};
+
+#endif // ROSETTABOY_STATS_H
@@ -0,0 +1,156 @@
+#include "tiles.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace Tiles {
+    static void decode_rows_scalar(const u8 *rows, int n, u8 *out) {
+        for(int y = 0; y < n; y++) {
+            u8 low_byte = rows[y * 2];
+            u8 high_byte = rows[y * 2 + 1];
+            for(int x = 0; x < 8; x++) {
+                u8 low_bit = (low_byte >> (7 - x)) & 0x01;
+                u8 high_bit = (high_byte >> (7 - x)) & 0x01;
+                out[y * 8 + x] = (high_bit << 1) | low_bit;
+            }
+        }
+    }
+
+    static void map_palette_scalar(const u8 *indices, int n, const u32 *palette, u32 *out) {
+        for(int i = 0; i < n; i++) {
+            out[i] = palette[indices[i]];
+        }
+    }
+
+    const Impl SCALAR = {"scalar", decode_rows_scalar, map_palette_scalar};
+
+#if defined(__x86_64__)
+    /**
+     * SSE2 doesn't have a byte shuffle, so each byte is spread out to
+     * fill 8 lanes by unpacking it with itself three times, and then
+     * each lane is tested against its own bit
+     */
+    static void decode_rows_sse2(const u8 *rows, int n, u8 *out) {
+        const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        const __m128i ones = _mm_set1_epi8(1);
+        const __m128i twos = _mm_set1_epi8(2);
+
+        int y = 0;
+        for(; y + 8 <= n; y += 8) {
+            // low bytes are the even bytes, high bytes are the odd bytes
+            __m128i raw = _mm_loadu_si128((const __m128i *)(rows + y * 2));
+            __m128i low16 = _mm_and_si128(raw, _mm_set1_epi16(0x00FF));
+            __m128i high16 = _mm_srli_epi16(raw, 8);
+            __m128i planes[2] = {_mm_packus_epi16(low16, low16), _mm_packus_epi16(high16, high16)};
+
+            // planes[p] = r0 r1 .. r7 -> spread[p][i] = r(2i) x8, r(2i+1) x8
+            __m128i spread[2][4];
+            for(int p = 0; p < 2; p++) {
+                __m128i x2 = _mm_unpacklo_epi8(planes[p], planes[p]);
+                __m128i x4_lo = _mm_unpacklo_epi16(x2, x2);
+                __m128i x4_hi = _mm_unpackhi_epi16(x2, x2);
+                spread[p][0] = _mm_unpacklo_epi32(x4_lo, x4_lo);
+                spread[p][1] = _mm_unpackhi_epi32(x4_lo, x4_lo);
+                spread[p][2] = _mm_unpacklo_epi32(x4_hi, x4_hi);
+                spread[p][3] = _mm_unpackhi_epi32(x4_hi, x4_hi);
+            }
+
+            for(int i = 0; i < 4; i++) {
+                __m128i low = _mm_cmpeq_epi8(_mm_and_si128(spread[0][i], bits), bits);
+                __m128i high = _mm_cmpeq_epi8(_mm_and_si128(spread[1][i], bits), bits);
+                __m128i px = _mm_or_si128(_mm_and_si128(low, ones), _mm_and_si128(high, twos));
+                _mm_storeu_si128((__m128i *)(out + y * 8 + i * 16), px);
+            }
+        }
+        decode_rows_scalar(rows + y * 2, n - y, out + y * 8);
+    }
+
+    /**
+     * Without a shuffle, each palette entry is selected by comparing
+     * all four lanes against its index
+     */
+    static void map_palette_sse2(const u8 *indices, int n, const u32 *palette, u32 *out) {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i colors[4], ids[4];
+        for(int c = 0; c < 4; c++) {
+            colors[c] = _mm_set1_epi32(palette[c]);
+            ids[c] = _mm_set1_epi32(c);
+        }
+
+        int i = 0;
+        for(; i + 4 <= n; i += 4) {
+            u32 packed;
+            __builtin_memcpy(&packed, indices + i, 4);
+            __m128i idx = _mm_cvtsi32_si128(packed);
+            idx = _mm_unpacklo_epi16(_mm_unpacklo_epi8(idx, zero), zero);
+            __m128i px = zero;
+            for(int c = 0; c < 4; c++) {
+                px = _mm_or_si128(px, _mm_and_si128(_mm_cmpeq_epi32(idx, ids[c]), colors[c]));
+            }
+            _mm_storeu_si128((__m128i *)(out + i), px);
+        }
+        map_palette_scalar(indices + i, n - i, palette, out + i);
+    }
+
+    const Impl SSE2 = {"sse2", decode_rows_sse2, map_palette_sse2};
+
+    /**
+     * Each 128-bit lane gets a copy of all 16 input bytes, and a byte
+     * shuffle spreads two rows' low or high bytes across it
+     */
+    __attribute__((target("avx2"))) static void decode_rows_avx2(const u8 *rows, int n, u8 *out) {
+        const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+        const __m256i ones = _mm256_set1_epi8(1);
+        const __m256i twos = _mm256_set1_epi8(2);
+        // rows 0 and 1 in the low lane, rows 2 and 3 in the high lane
+        const __m256i low_sel = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2, //
+                                                 4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+        const __m256i high_sel = _mm256_add_epi8(low_sel, ones);
+        const __m256i next_rows = _mm256_set1_epi8(8);
+
+        int y = 0;
+        for(; y + 8 <= n; y += 8) {
+            __m256i raw = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(rows + y * 2)));
+            for(int half = 0; half < 2; half++) {
+                __m256i offset = half ? next_rows : _mm256_setzero_si256();
+                __m256i low_bytes = _mm256_shuffle_epi8(raw, _mm256_add_epi8(low_sel, offset));
+                __m256i high_bytes = _mm256_shuffle_epi8(raw, _mm256_add_epi8(high_sel, offset));
+                __m256i low = _mm256_cmpeq_epi8(_mm256_and_si256(low_bytes, bits), bits);
+                __m256i high = _mm256_cmpeq_epi8(_mm256_and_si256(high_bytes, bits), bits);
+                __m256i px = _mm256_or_si256(_mm256_and_si256(low, ones), _mm256_and_si256(high, twos));
+                _mm256_storeu_si256((__m256i *)(out + y * 8 + half * 32), px);
+            }
+        }
+        decode_rows_scalar(rows + y * 2, n - y, out + y * 8);
+    }
+
+    /**
+     * The whole palette fits in one register, so vpermd can look up
+     * eight pixels at once
+     */
+    __attribute__((target("avx2"))) static void
+    map_palette_avx2(const u8 *indices, int n, const u32 *palette, u32 *out) {
+        const __m256i colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)palette));
+
+        int i = 0;
+        for(; i + 8 <= n; i += 8) {
+            __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indices + i)));
+            _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(colors, idx));
+        }
+        map_palette_scalar(indices + i, n - i, palette, out + i);
+    }
+
+    const Impl AVX2 = {"avx2", decode_rows_avx2, map_palette_avx2};
+
+    static const Impl &pick_best() {
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return AVX2;
+        return SSE2;
+    }
+#else
+    static const Impl &pick_best() { return SCALAR; }
+#endif
+
+    const Impl &best = pick_best();
+} // namespace Tiles
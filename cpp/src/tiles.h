@@ -0,0 +1,44 @@
+#ifndef ROSETTABOY_TILES_H
+#define ROSETTABOY_TILES_H
+
+#include "consts.h"
+
+/**
+ * Turning 2bpp tile data into colour indices, and colour indices into
+ * pixels, with SIMD versions that are picked at startup based on what
+ * the CPU supports
+ */
+namespace Tiles {
+    /**
+     * Expand `n` rows of tile data (each a low byte and a high byte)
+     * into 8 colour indices per row, leftmost pixel first
+     */
+    typedef void (*decode_rows_fn)(const u8 *rows, int n, u8 *out);
+
+    /**
+     * Look up `n` colour indices (0-3) in a 4-entry palette
+     */
+    typedef void (*map_palette_fn)(const u8 *indices, int n, const u32 *palette, u32 *out);
+
+    struct Impl {
+        const char *name;
+        decode_rows_fn decode_rows;
+        map_palette_fn map_palette;
+    };
+
+    extern const Impl SCALAR;
+#if defined(__x86_64__)
+    extern const Impl SSE2;
+    extern const Impl AVX2;
+#endif
+
+    // The fastest implementation that this CPU supports
+    extern const Impl &best;
+
+    inline void decode_rows(const u8 *rows, int n, u8 *out) { best.decode_rows(rows, n, out); }
+    inline void map_palette(const u8 *indices, int n, const u32 *palette, u32 *out) {
+        best.map_palette(indices, n, palette, out);
+    }
+} // namespace Tiles
+
+#endif // ROSETTABOY_TILES_H
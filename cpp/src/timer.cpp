@@ -0,0 +1,59 @@
+#include "timer.h"
+#include "cpu.h"
+
+// TIMA counts every 2^N cycles, depending on the bottom bits of TAC
+const u8 TIMA_SHIFTS[] = {8, 2, 4, 6};
+
+Timer::Timer(CPU *cpu) {
+    this->cpu = cpu;
+    this->ram = cpu->ram;
+    this->sync();
+}
+
+/**
+ * Catch up with the cycles which have passed since last time. We always
+ * sync just before the CPU runs an instruction, so if the CPU has written
+ * to the timer registers, it did so at the start of those cycles.
+ */
+void Timer::sync() {
+    if(this->ram->timer_written) {
+        // Writing anything to DIV resets the whole counter
+        if(this->ram->div_reset) this->counter = 0;
+        this->ram->timer_written = false;
+        this->ram->div_reset = false;
+    }
+
+    u32 start = this->counter;
+    u32 end = start + this->pending;
+    this->counter = end;
+    this->pending = 0;
+    this->ram->data[Mem::DIV] = (this->counter >> 6) & 0xFF;
+
+    u8 tac = this->ram->data[Mem::TAC];
+    if(!(tac & (1 << 2))) {
+        this->until_overflow = INT_MAX;
+        return;
+    }
+    u8 shift = TIMA_SHIFTS[tac & 0x03];
+    int tima = this->ram->data[Mem::TIMA] + ((end >> shift) - (start >> shift));
+    while(tima > 0xFF) {
+        tima = tima - 0x100 + this->ram->data[Mem::TMA];
+        this->cpu->interrupt(Interrupt::TIMER);
+    }
+    this->ram->data[Mem::TIMA] = tima;
+
+    int speed = 1 << shift;
+    this->until_overflow = (speed - (this->counter & (speed - 1))) + (0xFF - tima) * speed;
+}
+
+void Timer::save_state(StateWriter *out) {
+    out->put(this->counter);
+    out->put(this->pending);
+    out->put(this->until_overflow);
+}
+
+void Timer::load_state(StateReader *in) {
+    in->get(this->counter);
+    in->get(this->pending);
+    in->get(this->until_overflow);
+}
@@ -0,0 +1,50 @@
+#ifndef ROSETTABOY_TIMER_H
+#define ROSETTABOY_TIMER_H
+
+#include <climits>
+
+#include "consts.h"
+#include "ram.h"
+#include "state.h"
+
+class CPU;
+
+/**
+ * DIV and TIMA, driven by one internal counter (as in the hardware,
+ * DIV is the counter's top bits, and TIMA counts the falling edges of
+ * one of its lower bits).
+ *
+ * Rather than updating the registers in RAM every cycle, we just count
+ * how many cycles have passed, and bring the registers up to date in
+ * one go when the CPU is about to run an instruction (which might read
+ * them) or when TIMA is due to overflow (which raises an interrupt).
+ */
+class Timer {
+public:
+    Timer(CPU *cpu);
+
+    inline void tick(int cycles) {
+        this->pending += cycles;
+        if(this->pending >= this->until_overflow || this->ram->timer_written) this->sync();
+    }
+    void sync();
+    void save_state(StateWriter *out);
+    void load_state(StateReader *in);
+
+    /**
+     * How many cycles from now until TIMA overflows, counting the
+     * cycle where it does (or INT_MAX if the timer isn't running)
+     */
+    inline int cycles_until_interrupt() { return this->until_overflow - this->pending; }
+
+private:
+    CPU *cpu;
+    RAM *ram;
+    u16 counter = 0;
+    // Cycles which have passed since the last sync()
+    int pending = 0;
+    // Cycles from the last sync() until TIMA overflows
+    int until_overflow;
+};
+
+#endif // ROSETTABOY_TIMER_H
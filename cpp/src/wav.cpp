@@ -0,0 +1,117 @@
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+
+#include "errors.h"
+#include "wav.h"
+
+// ~1.4s at 48kHz, so the disk sees a few large writes per second
+const size_t BUFFER_LEN = 64 * 1024;
+const u32 HEADER_LEN = 44;
+
+WavFile::WavFile(const std::string &path, int rate) {
+    this->path = path;
+    this->rate = rate;
+    this->wav = path.size() >= 4 && strcasecmp(path.c_str() + path.size() - 4, ".wav") == 0;
+    this->fp = fopen(path.c_str(), "wb");
+    if(!this->fp) throw new AudioFileError(path, errno);
+    if(this->wav && !this->write_header()) {
+        fclose(this->fp);
+        throw new AudioFileError(path, errno);
+    }
+
+    this->filling.reserve(BUFFER_LEN);
+    this->writing.reserve(BUFFER_LEN);
+    this->writer = std::thread(&WavFile::run, this);
+}
+
+/**
+ * Write out whatever is left, and then go back and fill in the header -
+ * errors are only reported rather than thrown, since we're most likely
+ * being destroyed because something else was thrown
+ */
+WavFile::~WavFile() {
+    {
+        std::unique_lock<std::mutex> lock(this->lock);
+        this->changed.wait(lock, [this] { return !this->busy; });
+        std::swap(this->filling, this->writing);
+        this->busy = true;
+        this->done = true;
+    }
+    this->changed.notify_all();
+    this->writer.join();
+
+    if(!this->error && this->wav) {
+        if(fseek(this->fp, 0, SEEK_SET) != 0 || !this->write_header()) this->error = errno;
+    }
+    if(fclose(this->fp) != 0 && !this->error) this->error = errno;
+    if(this->error && !this->reported) fprintf(stderr, "Error writing %s: %s\n", this->path.c_str(), strerror(this->error));
+}
+
+void WavFile::write(const StereoSample *samples, int count) {
+    this->filling.insert(this->filling.end(), samples, samples + count);
+    if(this->filling.size() >= BUFFER_LEN) this->hand_over();
+}
+
+/**
+ * Give the samples collected so far to the writer thread - after waiting
+ * for it to finish with the last lot, if it hasn't yet
+ */
+void WavFile::hand_over() {
+    std::unique_lock<std::mutex> lock(this->lock);
+    this->changed.wait(lock, [this] { return !this->busy; });
+    if(this->error && !this->reported) {
+        this->reported = true;
+        throw new AudioFileError(this->path, this->error);
+    }
+    std::swap(this->filling, this->writing);
+    this->busy = true;
+    lock.unlock();
+    this->changed.notify_all();
+}
+
+void WavFile::run() {
+    std::unique_lock<std::mutex> lock(this->lock);
+    while(true) {
+        this->changed.wait(lock, [this] { return this->busy || this->done; });
+        if(!this->busy) return; // done, and everything has been written
+
+        lock.unlock();
+        size_t len = this->writing.size() * sizeof(StereoSample);
+        int error = fwrite(this->writing.data(), 1, len, this->fp) == len ? 0 : errno;
+        this->writing.clear();
+        lock.lock();
+
+        this->data_len += len;
+        if(error) this->error = error;
+        this->busy = false;
+        this->changed.notify_all();
+    }
+}
+
+/**
+ * 16-bit stereo PCM - the samples are written as they are in memory,
+ * which matches WAV's little-endian on everything we run on
+ */
+bool WavFile::write_header() {
+    u16 channels = 2, bits = 16, format = 1, block_align = channels * bits / 8;
+    u32 fmt_len = 16, riff_len = HEADER_LEN - 8 + this->data_len, byte_rate = this->rate * block_align;
+    u8 header[HEADER_LEN], *at = header;
+    auto put = [&at](const void *src, size_t len) {
+        memcpy(at, src, len);
+        at += len;
+    };
+    put("RIFF", 4);
+    put(&riff_len, 4);
+    put("WAVEfmt ", 8);
+    put(&fmt_len, 4);
+    put(&format, 2);
+    put(&channels, 2);
+    put(&this->rate, 4);
+    put(&byte_rate, 4);
+    put(&block_align, 2);
+    put(&bits, 2);
+    put("data", 4);
+    put(&this->data_len, 4);
+    return fwrite(header, 1, HEADER_LEN, this->fp) == HEADER_LEN;
+}
@@ -0,0 +1,53 @@
+#ifndef ROSETTABOY_WAV_H
+#define ROSETTABOY_WAV_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "apu.h"
+
+/**
+ * Sound going to a file instead of a speaker - a .wav, or raw 16-bit
+ * stereo PCM for any other name. The WAV header's lengths are filled
+ * in when the file is closed.
+ *
+ * Samples are collected in one big buffer while a thread of our own
+ * writes out the previous one, so the emulator only waits for the disk
+ * if it's making sound faster than the disk can take it.
+ */
+class WavFile {
+public:
+    WavFile(const std::string &path, int rate);
+    ~WavFile();
+    void write(const StereoSample *samples, int count);
+
+private:
+    std::string path;
+    FILE *fp;
+    bool wav;
+    int rate;
+    u32 data_len = 0;
+
+    // `filling` belongs to the emulator; `writing` belongs to the writer
+    // thread while `busy` is set
+    std::vector<StereoSample> filling;
+    std::vector<StereoSample> writing;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool busy = false;
+    bool done = false;
+    int error = 0;
+    // Whether `error` has been thrown already - it's only reported once
+    bool reported = false;
+    std::thread writer;
+
+    void hand_over();
+    void run();
+    bool write_header();
+};
+
+#endif // ROSETTABOY_WAV_H